@@ -0,0 +1,293 @@
+#ifndef COMPACT_TREE_HPP
+#define COMPACT_TREE_HPP
+
+#include <cstdint>
+
+#include "tree_operations.hpp"
+
+// Index-based copy of the link structure of a genesis Tree. treesearch_nni scores its candidates
+// and keeps its best tree on it, and the stepwise addition and exhaustive start trees insert
+// leaves on it. The SPR search and the annealers still move the genesis Tree, which TreeScores
+// needs for its updates.
+//
+// Links, edges and nodes keep the indices they have in the Tree. next(), link_node() and
+// node_link() never change under NNI or SPR, so they are stored once. Everything a move rewires
+// (outer and edge of every link, primary and secondary link of every edge) lives in one flat
+// array, so a snapshot is a single vector copy and every write can be journaled for undo.
+// nni_a, nni_b and spr mirror nni_a_inplace, nni_b_inplace and spr() link for link, so a move
+// sequence gives the same topology (and the same edge indices) on both representations.
+// With room for extra leaves, leaves can be inserted and removed again in place (for tree
+// enumeration); their links, nodes and edges are appended like add_new_node does.
+class CompactTree {
+public:
+    typedef std::vector<uint32_t> Snapshot;
+
+    explicit CompactTree(const Tree& tree, size_t extraLeaves = 0);
+
+    size_t link_count() const { return links_; }
+    size_t edge_count() const { return edges_; }
+    size_t node_count() const { return nodes_; }
+
+    size_t next(size_t l) const { return next_[l]; }
+    size_t outer(size_t l) const { return state[l]; }
+    size_t link_edge(size_t l) const { return state[link_capacity + l]; }
+    size_t link_node(size_t l) const { return link_node_[l]; }
+    size_t primary_link(size_t e) const { return state[2 * link_capacity + e]; }
+    size_t secondary_link(size_t e) const { return state[2 * link_capacity + edge_capacity + e]; }
+    size_t node_link(size_t n) const { return node_link_[n]; }
+
+    bool is_leaf(size_t n) const { return next_[node_link_[n]] == node_link_[n]; }
+    bool is_root(size_t n) const { return node_link_[n] == root_link; }
+    bool is_inner_edge(size_t e) const {
+        return !is_leaf(link_node(primary_link(e))) and !is_leaf(link_node(secondary_link(e)));
+    }
+
+    void nni_a(size_t e);
+    void nni_b(size_t e);
+    void spr(size_t pruneEdgeIdx, size_t regraftEdgeIdx);
+    bool valid_spr_move(size_t pruneEdgeIdx, size_t regraftEdgeIdx) const;
+
+    // Splits edge e with a new inner node and attaches a new leaf to it; returns the leaf node.
+    // e keeps the half at its primary link. remove_leaf() takes back the last insertion, which
+    // needs the journal entries since then.
+    size_t insert_leaf(size_t e);
+    void remove_leaf();
+
+    // Every change since the last commit() or restore() is journaled. undo(m) takes the tree back
+    // to the state it had when mark() returned m.
+    size_t mark() const { return journal.size(); }
+    void undo(size_t m);
+    void commit() { journal.clear(); }
+
+    Snapshot snapshot() const { return state; }
+    void restore(const Snapshot& s) { state = s; journal.clear(); }
+
+    // Rewires tree, which must be the tree this was built from or a copy of it, to this topology.
+    // Not for trees with inserted leaves.
+    void write(Tree& tree) const;
+
+private:
+    size_t links_, edges_, nodes_;
+    size_t link_capacity, edge_capacity;
+    std::vector<uint32_t> next_;
+    std::vector<uint32_t> link_node_;
+    std::vector<uint32_t> node_link_;
+    size_t root_link;
+    // Journal position before each inserted leaf.
+    std::vector<size_t> insertions;
+
+    // outer | link edge | primary link | secondary link
+    std::vector<uint32_t> state;
+    std::vector<std::pair<size_t, uint32_t> > journal;
+
+    void set(size_t pos, size_t value) {
+        journal.push_back({pos, state[pos]});
+        state[pos] = value;
+    }
+    void set_outer(size_t l, size_t o) { set(l, o); }
+    void set_link_edge(size_t l, size_t e) { set(link_capacity + l, e); }
+    void set_primary_link(size_t e, size_t l) { set(2 * link_capacity + e, l); }
+    void set_secondary_link(size_t e, size_t l) { set(2 * link_capacity + edge_capacity + e, l); }
+
+    void swap_subtrees(size_t a, size_t b);
+    void reconnect_node_secondary(size_t e, size_t l);
+    void swap_edges(size_t e1, size_t e2);
+};
+
+CompactTree::CompactTree(const Tree& tree, size_t extraLeaves)
+    : links_(tree.link_count()), edges_(tree.edge_count()), nodes_(tree.node_count()),
+      link_capacity(links_ + 4 * extraLeaves), edge_capacity(edges_ + 2 * extraLeaves),
+      next_(link_capacity), link_node_(link_capacity), node_link_(nodes_ + 2 * extraLeaves),
+      root_link(tree.root_link().index()), state(2 * link_capacity + 2 * edge_capacity) {
+    const size_t L = link_capacity;
+    const size_t E = edge_capacity;
+    for (size_t l = 0; l < links_; ++l) {
+        next_[l] = tree.link_at(l).next().index();
+        link_node_[l] = tree.link_at(l).node().index();
+        state[l] = tree.link_at(l).outer().index();
+        state[L + l] = tree.link_at(l).edge().index();
+    }
+    for (size_t e = 0; e < edges_; ++e) {
+        state[2*L + e] = tree.edge_at(e).primary_link().index();
+        state[2*L + E + e] = tree.edge_at(e).secondary_link().index();
+    }
+    for (size_t n = 0; n < nodes_; ++n) node_link_[n] = tree.node_at(n).link().index();
+}
+
+void CompactTree::write(Tree& tree) const {
+    for (size_t l = 0; l < link_count(); ++l) {
+        tree.link_at(l).reset_outer(&tree.link_at(outer(l)));
+        tree.link_at(l).reset_edge(&tree.edge_at(link_edge(l)));
+    }
+    for (size_t e = 0; e < edge_count(); ++e) {
+        tree.edge_at(e).reset_primary_link(&tree.link_at(primary_link(e)));
+        tree.edge_at(e).reset_secondary_link(&tree.link_at(secondary_link(e)));
+    }
+}
+
+void CompactTree::undo(size_t m) {
+    while (journal.size() > m) {
+        state[journal.back().first] = journal.back().second;
+        journal.pop_back();
+    }
+}
+
+// Exchanges the subtrees behind links a and b, which point away from the NNI edge. The edges stay
+// with a and b.
+void CompactTree::swap_subtrees(size_t a, size_t b) {
+    const size_t A = outer(a);
+    const size_t B = outer(b);
+    set_outer(A, b);
+    set_outer(B, a);
+    set_outer(a, B);
+    set_outer(b, A);
+    set_secondary_link(link_edge(a), B);
+    set_secondary_link(link_edge(b), A);
+    set_link_edge(B, link_edge(a));
+    set_link_edge(A, link_edge(b));
+}
+
+void CompactTree::nni_a(size_t e) {
+    const size_t p = primary_link(e);
+    const size_t s = secondary_link(e);
+    if (secondary_link(link_edge(next(p))) == next(p)) swap_subtrees(next(next(p)), next(s));
+    else swap_subtrees(next(p), next(next(s)));
+}
+
+void CompactTree::nni_b(size_t e) {
+    const size_t p = primary_link(e);
+    const size_t s = secondary_link(e);
+    if (secondary_link(link_edge(next(p))) == next(p)) swap_subtrees(next(next(p)), next(next(s)));
+    else swap_subtrees(next(p), next(s));
+}
+
+void CompactTree::reconnect_node_secondary(size_t e, size_t l) {
+    const size_t p = primary_link(e);
+    set_secondary_link(e, l);
+    set_link_edge(l, e);
+    set_outer(l, p);
+    set_outer(p, l);
+}
+
+void CompactTree::swap_edges(size_t e1, size_t e2) {
+    const size_t e1pl = primary_link(e1);
+    const size_t e1sl = secondary_link(e1);
+    const size_t e2pl = primary_link(e2);
+    const size_t e2sl = secondary_link(e2);
+    set_primary_link(e1, e2pl);
+    set_secondary_link(e1, e2sl);
+    set_primary_link(e2, e1pl);
+    set_secondary_link(e2, e1sl);
+    set_link_edge(e1pl, e2);
+    set_link_edge(e1sl, e2);
+    set_link_edge(e2pl, e1);
+    set_link_edge(e2sl, e1);
+}
+
+void CompactTree::spr(size_t pruneEdgeIdx, size_t regraftEdgeIdx) {
+    const size_t pruneLink = primary_link(pruneEdgeIdx);
+    const size_t link_prune_no = outer(next(pruneLink));
+
+    if (!is_root(link_node(pruneLink))) {
+        const size_t link_prune_nno = outer(next(next(pruneLink)));
+        size_t link_prune_parent, link_prune_sibling;
+        if (link_prune_no == primary_link(link_edge(node_link(link_node(pruneLink))))) {
+            link_prune_parent = link_prune_no;
+            link_prune_sibling = link_prune_nno;
+        } else {
+            link_prune_parent = link_prune_nno;
+            link_prune_sibling = link_prune_no;
+        }
+
+        const size_t edge_prune_sibling = link_edge(link_prune_sibling);
+        const size_t edge_prune_parent = link_edge(link_prune_parent);
+        const size_t link_prune_parent_secondary = secondary_link(edge_prune_parent);
+        const size_t link_regraft_secondary = secondary_link(regraftEdgeIdx);
+
+        reconnect_node_secondary(edge_prune_parent, link_prune_sibling);
+        reconnect_node_secondary(regraftEdgeIdx, link_prune_parent_secondary);
+        reconnect_node_secondary(edge_prune_sibling, link_regraft_secondary);
+
+        swap_edges(regraftEdgeIdx, edge_prune_parent);
+    } else {
+        const size_t link_prune_nno = next(next(pruneLink));
+        const size_t edge_prune_n = link_edge(link_prune_no);
+        const size_t edge_prune_nn = link_edge(link_prune_nno);
+        const size_t link_regraft_secondary = secondary_link(regraftEdgeIdx);
+
+        // Euler tour through the subtree behind pruneLink.next().
+        bool regraftInNext = false;
+        for (size_t l = next(link_prune_no); l != link_prune_nno; l = next(outer(l))) {
+            if (link_edge(l) == regraftEdgeIdx) regraftInNext = true;
+        }
+
+        const size_t link_prune_n_sec = secondary_link(edge_prune_n);
+        const size_t link_prune_nn_sec = secondary_link(edge_prune_nn);
+        if (regraftInNext) {
+            reconnect_node_secondary(edge_prune_n, link_regraft_secondary);
+            reconnect_node_secondary(edge_prune_nn, link_prune_n_sec);
+            reconnect_node_secondary(regraftEdgeIdx, link_prune_nn_sec);
+        } else {
+            reconnect_node_secondary(edge_prune_nn, link_regraft_secondary);
+            reconnect_node_secondary(edge_prune_n, link_prune_nn_sec);
+            reconnect_node_secondary(regraftEdgeIdx, link_prune_n_sec);
+        }
+    }
+}
+
+size_t CompactTree::insert_leaf(size_t e) {
+    if (links_ + 4 > link_capacity) throw std::runtime_error("CompactTree has no room for another leaf");
+    insertions.push_back(mark());
+    const size_t p = primary_link(e);
+    const size_t s = secondary_link(e);
+    // New inner node v with links up (to p), down (to s) and to the new leaf w.
+    const size_t v = nodes_, w = nodes_ + 1;
+    const size_t up = links_, down = links_ + 1, to_leaf = links_ + 2, leaf = links_ + 3;
+    const size_t e_down = edges_, e_leaf = edges_ + 1;
+    next_[up] = down; next_[down] = to_leaf; next_[to_leaf] = up; next_[leaf] = leaf;
+    link_node_[up] = link_node_[down] = link_node_[to_leaf] = v;
+    link_node_[leaf] = w;
+    node_link_[v] = up;
+    node_link_[w] = leaf;
+    links_ += 4; edges_ += 2; nodes_ += 2;
+
+    // New entries are not journaled, remove_leaf() just drops them.
+    state[up] = p; state[link_capacity + up] = e;
+    state[down] = s; state[link_capacity + down] = e_down;
+    state[to_leaf] = leaf; state[link_capacity + to_leaf] = e_leaf;
+    state[leaf] = to_leaf; state[link_capacity + leaf] = e_leaf;
+    state[2 * link_capacity + e_down] = down;
+    state[2 * link_capacity + edge_capacity + e_down] = s;
+    state[2 * link_capacity + e_leaf] = to_leaf;
+    state[2 * link_capacity + edge_capacity + e_leaf] = leaf;
+    set_secondary_link(e, up);
+    set_outer(p, up);
+    set_outer(s, down);
+    set_link_edge(s, e_down);
+    return w;
+}
+
+void CompactTree::remove_leaf() {
+    undo(insertions.back());
+    insertions.pop_back();
+    links_ -= 4; edges_ -= 2; nodes_ -= 2;
+}
+
+bool CompactTree::valid_spr_move(size_t pruneEdgeIdx, size_t regraftEdgeIdx) const {
+    if (pruneEdgeIdx >= edge_count() or regraftEdgeIdx >= edge_count()) return false;
+    if (pruneEdgeIdx == regraftEdgeIdx) return false;
+    const size_t p = primary_link(pruneEdgeIdx);
+    if (regraftEdgeIdx == link_edge(next(p))) return false;
+    if (regraftEdgeIdx == link_edge(next(next(p)))) return false;
+
+    size_t l = p;
+    do {
+        if (link_edge(l) == pruneEdgeIdx and l == secondary_link(pruneEdgeIdx)) break;
+        if (link_edge(l) == regraftEdgeIdx) return false;
+        l = next(outer(l));
+    } while (l != p);
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef EVAL_TREES_HPP
+#define EVAL_TREES_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+
+#include "tree_operations.hpp"
+#include "taxon_dictionary.hpp"
+
+// The evaluation trees, parsed once and kept as plain adjacency lists with taxon ids at the
+// leaves. Tree count, taxon set, quartet counts and distance statistics are all derived from this
+// instead of re-reading the Newick file for each of them. Taxa are numbered by their position in
+// the sorted list of leaf names, like in leafNames(). The same single read of the file also
+// hashes it, which identifies the evaluation trees a saved quartet table was counted from.
+class EvalTrees {
+public:
+    explicit EvalTrees(const std::string &evalTreesPath);
+
+    const std::string& path() const { return path_; }
+    // FNV-1a hash of the file contents.
+    uint64_t content_hash() const { return content_hash_; }
+    size_t size() const { return trees.size(); }
+    const TaxonDictionary& dictionary() const { return dictionary_; }
+    const std::vector<std::string>& taxa() const { return dictionary_.names(); }
+    size_t taxon_id(const std::string& name) const { return dictionary_.id(name); }
+
+    // Taxon ids of the leaves of tree t and the distances (in edges) between them, row-major.
+    void leaf_distances(size_t t, std::vector<uint32_t>& leaf_taxa, std::vector<uint32_t>& dist) const;
+
+private:
+    struct GeneTree {
+        // Neighbours of node v are adjacent[offsets[v] .. offsets[v+1]).
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> adjacent;
+        std::vector<uint32_t> leaves;
+        std::vector<uint32_t> leaf_taxa;
+    };
+
+    std::string path_;
+    uint64_t content_hash_;
+    TaxonDictionary dictionary_;
+    std::vector<GeneTree> trees;
+
+    // Leaves get ids in order of appearance while parsing and are renumbered once all taxa are known.
+    void add_tree(const Tree& tree, std::map<std::string, uint32_t>& seen, std::vector<std::string>& seen_names);
+};
+
+EvalTrees::EvalTrees(const std::string &evalTreesPath) : path_(evalTreesPath), content_hash_(14695981039346656037ULL) {
+    std::map<std::string, uint32_t> seen;
+    std::vector<std::string> seen_names;
+
+    std::ifstream in(evalTreesPath, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot read " + evalTreesPath);
+    // The file is read in blocks, hashed and cut into trees at every ';' outside of comments and
+    // quoted labels.
+    std::vector<char> buffer(1 << 16);
+    std::string newick;
+    bool in_comment = false, in_quote = false;
+    while (in) {
+        in.read(buffer.data(), buffer.size());
+        for (std::streamsize i = 0; i < in.gcount(); ++i) {
+            const char c = buffer[i];
+            content_hash_ ^= (unsigned char)c;
+            content_hash_ *= 1099511628211ULL;
+            newick += c;
+            if (in_comment) in_comment = (c != ']');
+            else if (in_quote) in_quote = (c != '\'');
+            else if (c == '[') in_comment = true;
+            else if (c == '\'') in_quote = true;
+            else if (c == ';') {
+                add_tree(DefaultTreeNewickReader().from_string(newick), seen, seen_names);
+                newick.clear();
+            }
+        }
+    }
+    if (newick.find_first_not_of(" \t\r\n") != std::string::npos)
+        throw std::runtime_error(evalTreesPath + " ends with a tree without ';'");
+
+    std::vector<std::string> names;
+    std::vector<uint32_t> renumber(seen_names.size());
+    for (auto it = seen.begin(); it != seen.end(); ++it) {
+        renumber[it->second] = names.size();
+        names.push_back(it->first);
+    }
+    dictionary_ = TaxonDictionary(names);
+    for (GeneTree& gt : trees) {
+        for (uint32_t& x : gt.leaf_taxa) x = renumber[x];
+    }
+}
+
+void EvalTrees::add_tree(const Tree& tree, std::map<std::string, uint32_t>& seen, std::vector<std::string>& seen_names) {
+    GeneTree gt;
+    gt.offsets.assign(tree.node_count() + 1, 0);
+    for (size_t e = 0; e < tree.edge_count(); ++e) {
+        gt.offsets[tree.edge_at(e).primary_link().node().index() + 1]++;
+        gt.offsets[tree.edge_at(e).secondary_link().node().index() + 1]++;
+    }
+    for (size_t v = 0; v < tree.node_count(); ++v) gt.offsets[v+1] += gt.offsets[v];
+    gt.adjacent.resize(gt.offsets.back());
+    std::vector<uint32_t> fill(gt.offsets.begin(), gt.offsets.end() - 1);
+    for (size_t e = 0; e < tree.edge_count(); ++e) {
+        const size_t u = tree.edge_at(e).primary_link().node().index();
+        const size_t v = tree.edge_at(e).secondary_link().node().index();
+        gt.adjacent[fill[u]++] = v;
+        gt.adjacent[fill[v]++] = u;
+    }
+
+    for (size_t v = 0; v < tree.node_count(); ++v) {
+        if (!tree.node_at(v).is_leaf()) continue;
+        const std::string& name = tree.node_at(v).data<DefaultNodeData>().name;
+        auto it = seen.find(name);
+        if (it == seen.end()) {
+            it = seen.insert({name, seen_names.size()}).first;
+            seen_names.push_back(name);
+        }
+        gt.leaves.push_back(v);
+        gt.leaf_taxa.push_back(it->second);
+    }
+    trees.push_back(std::move(gt));
+}
+
+void EvalTrees::leaf_distances(size_t t, std::vector<uint32_t>& leaf_taxa, std::vector<uint32_t>& dist) const {
+    const GeneTree& gt = trees[t];
+    const size_t k = gt.leaves.size();
+    leaf_taxa = gt.leaf_taxa;
+    dist.resize(k * k);
+
+    // One traversal per leaf.
+    std::vector<uint32_t> node_dist(gt.offsets.size() - 1);
+    std::vector<std::pair<uint32_t, uint32_t> > stack;
+    for (size_t i = 0; i < k; ++i) {
+        stack.push_back({gt.leaves[i], gt.leaves[i]});
+        node_dist[gt.leaves[i]] = 0;
+        while (!stack.empty()) {
+            const uint32_t v = stack.back().first;
+            const uint32_t from = stack.back().second;
+            stack.pop_back();
+            for (uint32_t a = gt.offsets[v]; a < gt.offsets[v+1]; ++a) {
+                const uint32_t w = gt.adjacent[a];
+                if (w == from) continue;
+                node_dist[w] = node_dist[v] + 1;
+                stack.push_back({w, v});
+            }
+        }
+        for (size_t j = 0; j < k; ++j) dist[i * k + j] = node_dist[gt.leaves[j]];
+    }
+}
+
+#endif
@@ -4,98 +4,131 @@
 #include "nni.hpp"
 #include "spr.hpp"
 #include "objective_function.hpp"
+#include "score_delta.hpp"
+
+// Best move seen during a scan of the NNI neighbourhood. Ties are broken towards the lowest edge
+// index and nni_a before nni_b, i.e. the order a serial scan visits the moves in, so the result
+// does not depend on how the edges were split across threads.
+struct NniCandidate {
+    double delta = std::numeric_limits<double>::lowest();
+    size_t edge = std::numeric_limits<size_t>::max();
+    NniVariant variant = NNI_A;
+
+    void consider(double d, size_t e, NniVariant v) {
+        if (d > delta or (d == delta and std::make_pair(e, v) < std::make_pair(edge, variant))) {
+            delta = d;
+            edge = e;
+            variant = v;
+        }
+    }
+    void consider(const NniCandidate& other) { consider(other.delta, other.edge, other.variant); }
+};
 
-template<typename CINT>
+template<typename CINT, typename Objective>
 Tree treesearch_nni(Tree& tree,
-                    QuartetScoreComputer<CINT>& qsc,
-                    ObjectiveFunction objective,
+                    TreeScores<CINT>& qsc,
+                    const QuartetCounts<CINT>& counts,
+                    const Objective& functions,
                     bool restricted) {
-    Functions<CINT> functions = Functions<CINT>(objective);
 
     Tree tnew = tree;
-    qsc.recomputeScores(tnew, false);
-    double oldscore = functions.obj_fun(qsc);
-
-    Tree global_best = tnew;
-    double global_max = oldscore;
+    qsc.recomputeScores(tnew);
+    ObjectiveSum<CINT, Objective> objective_sum(qsc, functions);
+    double oldscore = objective_sum.value();
+    const DeltaScorer<CINT> scorer(tnew, counts, functions.id);
+
+    // Candidates are scored on the compact copy; tnew follows the accepted moves only because the
+    // TreeScores need a genesis Tree. Only improving moves are accepted, so the current
+    // tree is always the best one seen.
+    CompactTree compact(tnew);
+
+    // NNI moves keep inner edges inner, so the list of candidate edges is fixed for the whole search.
+    std::vector<size_t> inner_edges;
+    for (size_t i = 0; i < compact.edge_count(); i++) {
+        if (compact.is_inner_edge(i)) inner_edges.push_back(i);
+    }
 
     while (true) {
-        double max = std::numeric_limits<double>::lowest();
-        Tree best;
-        qsc.recomputeScores(tnew, false);
-
-
-        for (size_t i = 0; i < tnew.edge_count(); i++) {
-            if (!(tnew.edge_at(i).primary_link().node().is_inner() && tnew.edge_at(i).secondary_link().node().is_inner()))
-                continue; //edge is no internode
-            if (functions.nni_restrict_edge(tnew, i, qsc, restricted)) continue;
-
-            functions.nni_a(tnew, i, qsc);
-            double sum = functions.obj_fun(qsc);
-            if (sum > max) {
-                max = sum;
-                best = Tree(tnew);
+        // The scan only reads compact, tnew and qsc, so the threads share them.
+        NniCandidate best;
+        #pragma omp parallel
+        {
+            NniCandidate local_best;
+            #pragma omp for schedule(dynamic) nowait
+            for (size_t k = 0; k < inner_edges.size(); ++k) {
+                const size_t i = inner_edges[k];
+                if (functions.nni_restrict_edge(tnew, i, qsc, restricted)) continue;
+
+                local_best.consider(score_delta_nni(compact, i, NNI_A, scorer), i, NNI_A);
+                local_best.consider(score_delta_nni(compact, i, NNI_B, scorer), i, NNI_B);
             }
-            functions.nni_a(tnew, i, qsc);
 
-            functions.nni_b(tnew, i, qsc);
-            sum = functions.obj_fun(qsc);
-            if (sum > max) {
-                max = sum;
-                best = Tree(tnew);
-            }
-            functions.nni_b(tnew, i, qsc);
+            #pragma omp critical
+            best.consider(local_best);
         }
+        if (!(best.delta > 0)) break;
 
-        if (max > oldscore) {
-            tnew = best;
-            oldscore = max;
-            LOG_INFO << "NNI best: " << max << std::endl;
-            if (max > global_max) {
-                global_max = max;
-                global_best = tnew;
-            }
+        const size_t mark = compact.mark();
+        if (best.variant == NNI_A) {
+            functions.nni_a(tnew, best.edge, qsc);
+            compact.nni_a(best.edge);
         } else {
+            functions.nni_b(tnew, best.edge, qsc);
+            compact.nni_b(best.edge);
+        }
+        objective_sum.nni_update(tnew, best.edge);
+        double score = objective_sum.value();
+        if (score <= oldscore) {
+            // Rounding made a neutral move look like an improvement.
+            if (best.variant == NNI_A) functions.nni_a(tnew, best.edge, qsc);
+            else functions.nni_b(tnew, best.edge, qsc);
+            compact.undo(mark);
             break;
         }
+        compact.commit();
+
+        oldscore = score;
+        LOG_INFO << "NNI best: " << score << std::endl;
     }
-    qsc.recomputeScores(global_best, false);
+    qsc.recomputeScores(tnew);
 
-    return global_best;
+    return tnew;
 }
 
 
-template<typename CINT>
+template<typename CINT, typename Objective>
 Tree treesearch_combo(Tree& tree,
-                      QuartetScoreComputer<CINT>& qsc,
-                      ObjectiveFunction objective,
+                      TreeScores<CINT>& qsc,
+                      const QuartetCounts<CINT>& counts,
+                      const Objective& functions,
                       bool restricted) {
-    Functions<CINT> functions = Functions<CINT>(objective);
 
     Tree tnew = tree;
-    qsc.recomputeScores(tnew, false);
-    double oldscore = sum_lqic_scores(qsc);
+    qsc.recomputeScores(tnew);
+    ObjectiveSum<CINT, Objective> objective_sum(qsc, functions);
+    double oldscore = objective_sum.value();
 
-    Tree best = tnew;
+    // Like treesearch_nni, only improving moves are kept, so tnew is always the best tree.
     double max = oldscore;
 
     while (true) {
         bool found_tree = false;
-        tnew = best;
-        qsc.recomputeScores(tnew, false);
+        // Every tried move is undone, so tnew keeps this state for the whole scan.
+        const SprNeighborhood neighborhood(tnew);
+        std::vector<size_t> regraft;
 
         for (size_t i = 0; i < tnew.edge_count() and !found_tree; ++i) {
-            for (size_t j = 0; j < tnew.edge_count() and !found_tree; ++j) {
-                if (!validSprMove(tnew, i, j)) continue;
+            neighborhood.regraft_edges(i, regraft);
+            for (size_t j : regraft) {
                 if (functions.spr_restrict_edgepair(tnew, i, j, qsc, restricted)) continue;
 
                 spr(tnew, i, j);
                 functions.spr_score_update(tnew, i, j, qsc);
+                objective_sum.spr_update(tnew, i, j);
 
-                double sum = functions.obj_fun(qsc);
+                double sum = objective_sum.value();
                 if (sum > max) {
                     max = sum;
-                    best = tnew;
                     LOG_INFO << "best: " << max << std::endl;
                     found_tree = true;
                     break;
@@ -103,20 +136,102 @@ Tree treesearch_combo(Tree& tree,
 
                 spr(tnew, i, j);
                 functions.spr_score_update(tnew, i, j, qsc);
+                objective_sum.spr_update(tnew, i, j);
             }
         }
         if (found_tree) {
-            tnew = treesearch_nni(best, qsc, objective, restricted);
-            qsc.recomputeScores(tnew, false);
-            double sum = functions.obj_fun(qsc);
-            if (sum > max) {
-                max = sum;
-                best = tnew;
-            }
+            // treesearch_nni leaves qsc with the scores of the tree it returns.
+            tnew = treesearch_nni(tnew, qsc, counts, functions, restricted);
+            objective_sum.reset();
+            max = std::max(max, objective_sum.value());
         } else break;
     }
 
-    return best;
+    return tnew;
+}
+
+// Hill climbing with SPR moves whose regraft edge lies at most radius edges from the prune point,
+// like the lazy SPR rounds of RAxML. Each prune edge in turn is moved to its best regraft edge
+// within the radius if that improves the objective. Candidates are scored with the path updates
+// of spr_score_update, so their cost grows with the radius rather than with the tree.
+template<typename CINT, typename Objective>
+Tree treesearch_spr(Tree& tree,
+                    TreeScores<CINT>& qsc,
+                    const Objective& functions,
+                    bool restricted,
+                    size_t radius) {
+
+    Tree tnew = tree;
+    qsc.recomputeScores(tnew);
+    ObjectiveSum<CINT, Objective> objective_sum(qsc, functions);
+    double max = objective_sum.value();
+
+    std::vector<size_t> regraft;
+    bool improved = true;
+    while (improved) {
+        improved = false;
+        for (size_t i = 0; i < tnew.edge_count(); ++i) {
+            spr_regraft_edges_within(tnew, i, radius, regraft);
+            double best = max;
+            size_t best_j = tnew.edge_count();
+            for (size_t j : regraft) {
+                if (functions.spr_restrict_edgepair(tnew, i, j, qsc, restricted)) continue;
+
+                spr(tnew, i, j);
+                functions.spr_score_update(tnew, i, j, qsc);
+                objective_sum.spr_update(tnew, i, j);
+                if (objective_sum.value() > best) {
+                    best = objective_sum.value();
+                    best_j = j;
+                }
+                spr(tnew, i, j);
+                functions.spr_score_update(tnew, i, j, qsc);
+                objective_sum.spr_update(tnew, i, j);
+            }
+            if (best_j == tnew.edge_count()) continue;
+
+            spr(tnew, i, best_j);
+            functions.spr_score_update(tnew, i, best_j, qsc);
+            objective_sum.spr_update(tnew, i, best_j);
+            max = objective_sum.value();
+            improved = true;
+            LOG_INFO << "SPR best: " << max << std::endl;
+        }
+    }
+    qsc.recomputeScores(tnew);
+
+    return tnew;
+}
+
+// The searches above for an objective chosen at runtime.
+template<typename CINT>
+Tree treesearch_nni(Tree& tree, TreeScores<CINT>& qsc, const QuartetCounts<CINT>& counts, ObjectiveFunction objective, bool restricted) {
+    switch (objective) {
+    case LQIC: return treesearch_nni(tree, qsc, counts, LqicObjective<CINT>(), restricted);
+    case QPIC: return treesearch_nni(tree, qsc, counts, QpicObjective<CINT>(), restricted);
+    case EQPIC: return treesearch_nni(tree, qsc, counts, EqpicObjective<CINT>(), restricted);
+    }
+    return tree;
+}
+
+template<typename CINT>
+Tree treesearch_combo(Tree& tree, TreeScores<CINT>& qsc, const QuartetCounts<CINT>& counts, ObjectiveFunction objective, bool restricted) {
+    switch (objective) {
+    case LQIC: return treesearch_combo(tree, qsc, counts, LqicObjective<CINT>(), restricted);
+    case QPIC: return treesearch_combo(tree, qsc, counts, QpicObjective<CINT>(), restricted);
+    case EQPIC: return treesearch_combo(tree, qsc, counts, EqpicObjective<CINT>(), restricted);
+    }
+    return tree;
+}
+
+template<typename CINT>
+Tree treesearch_spr(Tree& tree, TreeScores<CINT>& qsc, ObjectiveFunction objective, bool restricted, size_t radius) {
+    switch (objective) {
+    case LQIC: return treesearch_spr(tree, qsc, LqicObjective<CINT>(), restricted, radius);
+    case QPIC: return treesearch_spr(tree, qsc, QpicObjective<CINT>(), restricted, radius);
+    case EQPIC: return treesearch_spr(tree, qsc, EqpicObjective<CINT>(), restricted, radius);
+    }
+    return tree;
 }
 
 
@@ -5,8 +5,6 @@
 #include <genesis/utils/core/logging.hpp>
 #include <genesis/utils/core/options.hpp>
 
-#include "QuartetScoreComputer.hpp"
-
 #include <string>
 #include <limits>
 #include <cstdio>
@@ -20,6 +18,7 @@
 #include "greedy.hpp"
 #include "simulated_annealing.hpp"
 #include "starttree.hpp"
+#include "replicates.hpp"
 
 #include "../externals/cli11/CLI11.hpp"
 
@@ -44,164 +43,215 @@ struct ResultsAndStats {
         return timeClustering + timeCountingQuartets + timeStartTree + timeFirstTreesearch + timeExpandCluster + timeFinalTreesearch; }
 };
 
-template<typename CINT>
-void doStuff(std::string pathToEvaluationTrees, int m, std::string startTreeMethod, std::string algorithm, std::string pathToOutput, std::string pathToStartTree, bool restrictByLqic, bool cached, float simannfactor, bool clustering, std::string treesearchAlgorithmClustered, ObjectiveFunction objectiveFunction) {
+template<typename CINT, typename Objective>
+void doStuff(const EvalTrees& evalTrees, int m, std::string startTreeMethod, std::string algorithm, std::string pathToOutput, std::string pathToStartTree, bool restrictByLqic, float simannfactor, bool clustering, std::string treesearchAlgorithmClustered, size_t restarts, size_t seed, std::string pathToSaveQuartets, std::string pathToLoadQuartets, size_t stepwiseOrders, double stepwiseMargin, size_t sprRadius, size_t temperingChains) {
 
+    const ObjectiveFunction objectiveFunction = Objective::id;
+    const Objective objective = Objective();
     ResultsAndStats res;
 
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
 
+    // The one quartet count table of the run. Start trees, move scoring and the edge scores of
+    // qsc all read it. Only the parallel counting (or the load) is timed, saving is not.
+    std::unique_ptr<QuartetCounts<CINT> > counts;
     begin = std::chrono::steady_clock::now();
-    Tree rand_tree = random_tree(pathToEvaluationTrees);
-    QuartetScoreComputer<CINT> qsc =
-        QuartetScoreComputer<CINT>(rand_tree, pathToEvaluationTrees, m, true, true);
+    if (pathToLoadQuartets != "")
+        counts = std::unique_ptr<QuartetCounts<CINT> >(new QuartetCounts<CINT>(evalTrees, pathToLoadQuartets));
+    else
+        counts = std::unique_ptr<QuartetCounts<CINT> >(new QuartetCounts<CINT>(evalTrees));
     end = std::chrono::steady_clock::now();
     res.timeCountingQuartets =
         std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001;
+    if (pathToLoadQuartets != "")
+        LOG_INFO << "Loaded quartet counts from " << pathToLoadQuartets << " in " << res.timeCountingQuartets << " seconds." << std::endl;
+    else
+        LOG_INFO << "Counted quartets of " << m << " evaluation trees in " << res.timeCountingQuartets << " seconds ("
+                 << m / res.timeCountingQuartets << " trees/s)." << std::endl;
+    if (pathToSaveQuartets != "") counts->save(pathToSaveQuartets);
+    TreeScores<CINT> qsc(*counts);
 
     std::vector<std::string> leaves;
     std::vector<std::vector<std::string> > leafSets;
     if (clustering) {
         begin = std::chrono::steady_clock::now();
-        leafSets = leaf_sets(pathToEvaluationTrees);
+        leafSets = leaf_sets(evalTrees);
         for (auto x : leafSets) leaves.push_back(x[0]);
         end = std::chrono::steady_clock::now();
         res.timeClustering =
             std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001;
     } else {
-        leaves = leafNames(pathToEvaluationTrees);
+        leaves = evalTrees.taxa();
     }
-    std::shuffle(leaves.begin(), leaves.end(), Random::getMT());
 
-    begin = std::chrono::steady_clock::now();
-    Tree start_tree;
-    if (pathToStartTree == "") {
-        if (startTreeMethod == "stepwiseaddition")
-            start_tree = stepwise_addition_tree_from_leaves<CINT>(qsc, leaves, m, objectiveFunction);
-        else if (startTreeMethod == "random")
-            start_tree = random_tree_from_leaves(leaves);
-        else if (startTreeMethod == "exhaustive")
-            start_tree = exhaustive_search_from_leaves<CINT>(pathToEvaluationTrees, leaves, m, objectiveFunction);
-        else { LOG_ERR << startTreeMethod << " is unknown start tree method"; }
-    } else {
-        LOG_INFO << "Read start tree from file";
-        start_tree = DefaultTreeNewickReader().from_file(pathToStartTree);
-        if (start_tree.root_node().rank() == 1) {
-            std::cout << start_tree.node_count() << " " << start_tree.edge_count() << std::endl;
-            std::string newick = DefaultTreeNewickWriter().to_string(start_tree);
-            std::cout << newick << std::endl;
-
-            int c = 0; size_t a = 0; size_t b = newick.size(); size_t d = newick.size();
-            for (size_t i = 0; i < newick.size() and b == newick.size(); ++i) {
-                if (newick[i] == '(') c++;
-                if (newick[i] == ')') c--;
-                if (c == 2 and a == 0) a = i;
-                if (c == 1 and a > 0) {
-                    b = i;
-                    d = b;
-                    if (newick[i+1] == ':') {
-                        d++;
-                        while (newick[d] != ',' and newick[d] != ')') d++;
+    // One replicate: start tree, tree search on the clustered taxa, expansion and final tree search.
+    // Only reads the shared state above, so replicates can run concurrently on their own qsc.
+    auto search = [&](TreeScores<CINT>& qsc, std::vector<std::string> leaves, const std::string& startTreeMethod, ResultsAndStats& res) {
+        std::chrono::steady_clock::time_point begin, end;
+        std::shuffle(leaves.begin(), leaves.end(), Random::engine());
+
+        begin = std::chrono::steady_clock::now();
+        Tree start_tree;
+        if (pathToStartTree == "") {
+            if (startTreeMethod == "stepwiseaddition" and stepwiseOrders > 1)
+                start_tree = multi_order_stepwise_addition_tree<CINT>(*counts, leaves, objectiveFunction, stepwiseOrders, stepwiseMargin);
+            else if (startTreeMethod == "stepwiseaddition")
+                start_tree = stepwise_addition_tree_from_leaves<CINT>(*counts, leaves, objectiveFunction);
+            else if (startTreeMethod == "random")
+                start_tree = random_tree_from_leaves(leaves);
+            else if (startTreeMethod == "exhaustive")
+                start_tree = exhaustive_search_from_leaves<CINT>(*counts, leaves, objectiveFunction);
+            else { LOG_ERR << startTreeMethod << " is unknown start tree method"; }
+        } else {
+            LOG_INFO << "Read start tree from file";
+            start_tree = DefaultTreeNewickReader().from_file(pathToStartTree);
+            if (start_tree.root_node().rank() == 1) {
+                std::cout << start_tree.node_count() << " " << start_tree.edge_count() << std::endl;
+                std::string newick = DefaultTreeNewickWriter().to_string(start_tree);
+                std::cout << newick << std::endl;
+
+                int c = 0; size_t a = 0; size_t b = newick.size(); size_t d = newick.size();
+                for (size_t i = 0; i < newick.size() and b == newick.size(); ++i) {
+                    if (newick[i] == '(') c++;
+                    if (newick[i] == ')') c--;
+                    if (c == 2 and a == 0) a = i;
+                    if (c == 1 and a > 0) {
+                        b = i;
+                        d = b;
+                        if (newick[i+1] == ':') {
+                            d++;
+                            while (newick[d] != ',' and newick[d] != ')') d++;
+                        }
                     }
                 }
+                std::string newick2 = newick.substr(0, a) + newick.substr(a+1, b-a-1) + newick.substr(d, newick.size() - d);
+                start_tree = DefaultTreeNewickReader().from_string(newick2);
             }
-            std::string newick2 = newick.substr(0, a) + newick.substr(a+1, b-a-1) + newick.substr(d, newick.size() - d);
-            start_tree = DefaultTreeNewickReader().from_string(newick2);
         }
-    }
-
-    end = std::chrono::steady_clock::now();
-    end = std::chrono::steady_clock::now();
-    res.timeStartTree =
-        std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001;
-
-    LOG_INFO << "Finished computing start tree. It took: " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001 << " seconds." << std::endl;
-
-    LOG_INFO << PrinterCompact().print(start_tree);
 
-    if (!validate_topology(start_tree)) {
-        LOG_WARN << "Topology of start tree is not valid!";
-    } else { LOG_INFO << "Topology of start tree is ok!"; }
-
-    qsc.recomputeScores(start_tree, false);
-    switch (objectiveFunction) {
-    case LQIC:
-        LOG_INFO << "Sum LQIC start Tree: " << sum_lqic_scores(qsc) << std::endl;
-        break;
-    case QPIC:
-        LOG_INFO << "Sum QPIC start Tree: " << sum_qpic_scores(qsc) << std::endl;
-        break;
-    case EQPIC:
-        LOG_INFO << "Sum EQPIC start Tree: " << sum_eqpic_scores(qsc) << std::endl;
-        break;
-    }
-
-    if (cached) qsc.enableCache();
-    else qsc.disableCache();
+        end = std::chrono::steady_clock::now();
+        end = std::chrono::steady_clock::now();
+        res.timeStartTree =
+            std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001;
 
-    TODO(SPR algorithm in 1st and 2nd algorithm)
-    if (clustering) {
-        begin = std::chrono::steady_clock::now();
+        LOG_INFO << "Finished computing start tree. It took: " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001 << " seconds." << std::endl;
 
-        if (treesearchAlgorithmClustered == "nni")
-            start_tree = treesearch_nni<CINT>(start_tree, qsc, objectiveFunction, restrictByLqic);
-        else if (treesearchAlgorithmClustered == "spr")
-            throw std::runtime_error("Not implemented");
-        else if (treesearchAlgorithmClustered == "combo")
-            start_tree = treesearch_combo<CINT>(start_tree, qsc, objectiveFunction, restrictByLqic);
-        else if (treesearchAlgorithmClustered == "simann")
-            start_tree = simulated_annealing<CINT>(start_tree, qsc, false, objectiveFunction, simannfactor);
-        else if (treesearchAlgorithmClustered == "no")
-            start_tree = start_tree;
-        else  { LOG_ERR << treesearchAlgorithmClustered << " is unknown algorithm"; }
+        LOG_INFO << PrinterCompact().print(start_tree);
 
-        end = std::chrono::steady_clock::now();
-        res.timeFirstTreesearch =
-            std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001;
+        if (!validate_topology(start_tree)) {
+            LOG_WARN << "Topology of start tree is not valid!";
+        } else { LOG_INFO << "Topology of start tree is ok!"; }
 
-        qsc.recomputeScores(start_tree, false);
+        qsc.recomputeScores(start_tree);
         switch (objectiveFunction) {
         case LQIC:
-            LOG_INFO << "Sum LQIC cluster Tree: " << sum_lqic_scores(qsc) << std::endl; break;
+            LOG_INFO << "Sum LQIC start Tree: " << sum_lqic_scores(qsc) << std::endl;
+            break;
         case QPIC:
-            LOG_INFO << "Sum QPIC cluster Tree: " << sum_qpic_scores(qsc) << std::endl; break;
+            LOG_INFO << "Sum QPIC start Tree: " << sum_qpic_scores(qsc) << std::endl;
+            break;
         case EQPIC:
-            LOG_INFO << "Sum EQPIC cluster Tree: " << sum_eqpic_scores(qsc) << std::endl; break;
+            LOG_INFO << "Sum EQPIC start Tree: " << sum_eqpic_scores(qsc) << std::endl;
+            break;
         }
 
-        start_tree = expanded_cluster_tree(start_tree, leafSets);
+        if (clustering) {
+            begin = std::chrono::steady_clock::now();
+
+            if (treesearchAlgorithmClustered == "nni")
+                start_tree = treesearch_nni<CINT>(start_tree, qsc, *counts, objective, restrictByLqic);
+            else if (treesearchAlgorithmClustered == "spr")
+                start_tree = treesearch_spr<CINT>(start_tree, qsc, objective, restrictByLqic, sprRadius);
+            else if (treesearchAlgorithmClustered == "combo")
+                start_tree = treesearch_combo<CINT>(start_tree, qsc, *counts, objective, restrictByLqic);
+            else if (treesearchAlgorithmClustered == "simann")
+                start_tree = simulated_annealing<CINT>(start_tree, qsc, false, objective, simannfactor);
+            else if (treesearchAlgorithmClustered == "tempering")
+                start_tree = parallel_tempering<CINT>(start_tree, qsc, objective, temperingChains, simannfactor);
+            else if (treesearchAlgorithmClustered == "no")
+                start_tree = start_tree;
+            else  { LOG_ERR << treesearchAlgorithmClustered << " is unknown algorithm"; }
+
+            end = std::chrono::steady_clock::now();
+            res.timeFirstTreesearch =
+                std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001;
+
+            qsc.recomputeScores(start_tree);
+            switch (objectiveFunction) {
+            case LQIC:
+                LOG_INFO << "Sum LQIC cluster Tree: " << sum_lqic_scores(qsc) << std::endl; break;
+            case QPIC:
+                LOG_INFO << "Sum QPIC cluster Tree: " << sum_qpic_scores(qsc) << std::endl; break;
+            case EQPIC:
+                LOG_INFO << "Sum EQPIC cluster Tree: " << sum_eqpic_scores(qsc) << std::endl; break;
+            }
 
-        qsc.recomputeScores(start_tree, false);
-        switch (objectiveFunction) {
-        case LQIC:
-            LOG_INFO << "Sum LQIC expanded Tree: " << sum_lqic_scores(qsc) << std::endl; break;
-        case QPIC:
-            LOG_INFO << "Sum QPIC expanded Tree: " << sum_qpic_scores(qsc) << std::endl; break;
-        case EQPIC:
-            LOG_INFO << "Sum EQPIC expanded Tree: " << sum_eqpic_scores(qsc) << std::endl; break;
+            start_tree = expanded_cluster_tree(start_tree, leafSets);
+
+            qsc.recomputeScores(start_tree);
+            switch (objectiveFunction) {
+            case LQIC:
+                LOG_INFO << "Sum LQIC expanded Tree: " << sum_lqic_scores(qsc) << std::endl; break;
+            case QPIC:
+                LOG_INFO << "Sum QPIC expanded Tree: " << sum_qpic_scores(qsc) << std::endl; break;
+            case EQPIC:
+                LOG_INFO << "Sum EQPIC expanded Tree: " << sum_eqpic_scores(qsc) << std::endl; break;
+            }
         }
-    }
 
-    begin = std::chrono::steady_clock::now();
+        begin = std::chrono::steady_clock::now();
+        Tree final_tree;
+        if (algorithm == "nni")
+            final_tree = treesearch_nni<CINT>(start_tree, qsc, *counts, objective, restrictByLqic);
+        else if (algorithm == "spr")
+            final_tree = treesearch_spr<CINT>(start_tree, qsc, objective, restrictByLqic, sprRadius);
+        else if (algorithm == "combo")
+            final_tree = treesearch_combo<CINT>(start_tree, qsc, *counts, objective, restrictByLqic);
+        else if (algorithm == "simann")
+            final_tree = simulated_annealing<CINT>(start_tree, qsc, clustering, objective, simannfactor);
+        else if (algorithm == "tempering")
+            final_tree = parallel_tempering<CINT>(start_tree, qsc, objective, temperingChains, simannfactor);
+        else if (algorithm == "no")
+            final_tree = start_tree;
+        else  { LOG_ERR << algorithm << " is unknown algorithm"; }
+
+        end = std::chrono::steady_clock::now();
+        res.timeFinalTreesearch =
+            std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001;
+        LOG_INFO << "Finished computing final tree. It took: " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001 << " seconds." << std::endl;
+        qsc.recomputeScores(final_tree);
+        return final_tree;
+    };
+
     Tree final_tree;
-    if (algorithm == "nni")
-        final_tree = treesearch_nni<CINT>(start_tree, qsc, objectiveFunction, restrictByLqic);
-    else if (algorithm == "spr")
-        throw std::runtime_error("Not implemented");
-    else if (algorithm == "combo")
-        final_tree = treesearch_combo<CINT>(start_tree, qsc, objectiveFunction, restrictByLqic);
-    else if (algorithm == "simann")
-        final_tree = simulated_annealing<CINT>(start_tree, qsc, clustering, objectiveFunction, simannfactor);
-    else if (algorithm == "no")
-        final_tree = start_tree;
-    else  { LOG_ERR << algorithm << " is unknown algorithm"; }
+    if (restarts <= 1) {
+        final_tree = search(qsc, leaves, startTreeMethod, res);
+    } else {
+        // Independent replicates. Odd replicates use the other one of random and stepwise addition
+        // start trees.
+        const std::string otherStartTreeMethod = (startTreeMethod == "random") ? "stepwiseaddition" : "random";
+        std::vector<Tree> trees;
+        std::vector<double> scores;
+        std::vector<ResultsAndStats> stats(restarts);
 
-    end = std::chrono::steady_clock::now();
-    res.timeFinalTreesearch =
-        std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001;
-    LOG_INFO << "Finished computing final tree. It took: " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001 << " seconds." << std::endl;
-    qsc.recomputeScores(final_tree, false);
+        begin = std::chrono::steady_clock::now();
+        const size_t best = run_replicates<CINT, Objective>(*counts, restarts, seed,
+            [&](TreeScores<CINT>& local_qsc, size_t r) {
+                return search(local_qsc, leaves, (r % 2 == 0) ? startTreeMethod : otherStartTreeMethod, stats[r]);
+            }, trees, scores);
+        end = std::chrono::steady_clock::now();
+
+        for (size_t r = 0; r < restarts; ++r) LOG_INFO << "Replicate " << r << ": " << scores[r] << std::endl;
+        LOG_INFO << "Best replicate: " << best << std::endl;
+        LOG_INFO << "Time Restarts: " << std::fixed << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()*0.000001 << " seconds" << std::endl;
+
+        final_tree = trees[best];
+        res.timeStartTree = stats[best].timeStartTree;
+        res.timeFirstTreesearch = stats[best].timeFirstTreesearch;
+        res.timeFinalTreesearch = stats[best].timeFinalTreesearch;
+        qsc.recomputeScores(final_tree);
+    }
 
     LOG_INFO << "--------------------------------------------------" << std::endl;
     //LOG_INFO << "Sum LQIC final Tree: " << sum_lqic_scores(qsc) << std::endl;
@@ -222,6 +272,16 @@ void doStuff(std::string pathToEvaluationTrees, int m, std::string startTreeMeth
     DefaultTreeNewickWriter().to_file(final_tree, pathToOutput);
 }
 
+// Instantiates doStuff for the objective, so the searches call it directly.
+template<typename CINT, typename... Args>
+void doStuffWithObjective(ObjectiveFunction objectiveFunction, Args&&... args) {
+    switch (objectiveFunction) {
+    case LQIC: doStuff<CINT, LqicObjective<CINT> >(std::forward<Args>(args)...); break;
+    case QPIC: doStuff<CINT, QpicObjective<CINT> >(std::forward<Args>(args)...); break;
+    case EQPIC: doStuff<CINT, EqpicObjective<CINT> >(std::forward<Args>(args)...); break;
+    }
+}
+
 struct VectorValidator : public CLI::Validator {
     VectorValidator(std::vector<std::string> accepted) {
         std::stringstream out;
@@ -243,6 +303,20 @@ struct VectorValidator : public CLI::Validator {
     }
 };
 
+// Number of tempering chains: 0 for one per thread, otherwise at least two to exchange between.
+struct ChainsValidator : public CLI::Validator {
+    ChainsValidator() {
+        tname = "0|>=2";
+        func = [](std::string input) {
+                   if (input == "0") return std::string();
+                   try {
+                       if (std::stoll(input) >= 2) return std::string();
+                   } catch (const std::exception&) {}
+                   return std::string("Needs 0 (one chain per thread) or at least 2 chains");
+               };
+    }
+};
+
 int main(int argc, char* argv[]) {
     Logging::log_to_stdout ();
     Logging::details.level = false;
@@ -259,6 +333,13 @@ int main(int argc, char* argv[]) {
     size_t numThreads = 1;
     bool cached = false;
     size_t seed = 0;
+    size_t restarts = 1;
+    std::string pathToSaveQuartets;
+    std::string pathToLoadQuartets;
+    size_t stepwiseOrders = 1;
+    double stepwiseMargin = 1.0;
+    size_t sprRadius = 10;
+    size_t temperingChains = 0;
     float simannfactor = 0.005;
     bool clustering = false;
     std::string treesearchAlgorithmClustered = "same";
@@ -276,16 +357,23 @@ int main(int argc, char* argv[]) {
     app.add_option("--starttree", pathToStartTree, "Path to start tree file");
     app.add_option("-t, --numThreads", numThreads, "Number of Threads", true);
     app.add_option("--seed", seed, "Random seed", true);
+    app.add_option("--restarts", restarts, "Number of independent replicates, the best tree is written", true)->check(CLI::Range(1, 1000000));
+    app.add_option("--save-quartets", pathToSaveQuartets, "Write the quartet count table to this file");
+    app.add_option("--load-quartets", pathToLoadQuartets, "Read the quartet count table from a file written by --save-quartets")->check(CLI::ExistingFile);
+    app.add_option("--stepwise-orders", stepwiseOrders, "Number of taxon orders for stepwise addition, the best start tree is used", true)->check(CLI::Range(1, 1000000));
+    app.add_option("--stepwise-margin", stepwiseMargin, "Abandon a stepwise addition order once it is this far behind the best one with as many leaves", true);
     app.add_option("--objectiveFunction", objectiveFunctionStr, "The objective function to maximize.")->check(VectorValidator({ "lqic", "qpic", "eqpic" }));
 
     CLI::App* custom = app.add_subcommand("custom", "");
     custom->add_option("-s, --startTreeMethod", startTreeMethod, "Method to generate start tree")->required()->check(VectorValidator({"random", "stepwiseaddition", "exhaustive"}));
-    custom->add_option("-a, --algorithm", algorithm, "Algorithm to search tree")->required()->check(VectorValidator({"nni", "simann", "spr", "combo", "no"}));
+    custom->add_option("-a, --algorithm", algorithm, "Algorithm to search tree")->required()->check(VectorValidator({"nni", "simann", "tempering", "spr", "combo", "no"}));
+    custom->add_option("--spr-radius", sprRadius, "Maximum distance of the regraft edge from the prune edge for the spr algorithm", true)->check(CLI::Range(1, 1000000));
     custom->add_flag("-x, --restricted", restrictByLqic, "Restrict NNI and SPR moves to edges with negative LQIC score");
-    custom->add_flag("-c, --cached", cached, "Cache Scores");
+    custom->add_flag("-c, --cached", cached, "No effect, edge scores are always kept between moves. Accepted for old command lines");
     custom->add_flag("--clustering", clustering, "Cluster Taxa before Treesearch.");
     custom->add_option("--factor", simannfactor, "Factor for simulated_annealing.", true)->check(CLI::Range(0.001, 0.01));
-    custom->add_option("--treesearchAlgorithmClustered, --a0", treesearchAlgorithmClustered, "")->check(VectorValidator({"nni", "simann", "spr", "combo", "no", "same"}));
+    custom->add_option("--chains", temperingChains, "Number of chains for the tempering algorithm, 0 for one per thread", true)->check(ChainsValidator());
+    custom->add_option("--treesearchAlgorithmClustered, --a0", treesearchAlgorithmClustered, "")->check(VectorValidator({"nni", "simann", "tempering", "spr", "combo", "no", "same"}));
     custom->add_option("-l, --loglevel", loglevel, "Log Level")->check(VectorValidator({"None","Error","Warning","Info","Progress","Debug","Debug1","Debug2","Debug3","Debug4"}));
 
     CLI::App* ccsa = app.add_subcommand("ccsa", "Cached, clustered Simulated Annealing");
@@ -303,20 +391,17 @@ int main(int argc, char* argv[]) {
         algorithm = "nni";
         treesearchAlgorithmClustered = "simann";
         clustering = true;
-        cached = true;
     } else if (app.got_subcommand(ccnni)) {
         startTreeMethod = "stepwiseaddition";
         algorithm = "nni";
         treesearchAlgorithmClustered = "nni";
         clustering = true;
-        cached = true;
         restrictByLqic = true;
     } else if (app.got_subcommand(cccombo)) {
         startTreeMethod = "stepwiseaddition";
         algorithm = "combo";
         treesearchAlgorithmClustered = "combo";
         clustering = true;
-        cached = true;
         restrictByLqic = true;
     } else {
         throw std::runtime_error("Unknown subcommand");
@@ -338,6 +423,9 @@ int main(int argc, char* argv[]) {
     if (objectiveFunctionStr == "lqic") objectiveFunction = LQIC;
     if (objectiveFunctionStr == "qpic") objectiveFunction = QPIC;
     if (objectiveFunctionStr == "eqpic") objectiveFunction = EQPIC;
+    if (startTreeMethod == "exhaustive" and objectiveFunction != LQIC)
+        LOG_WARN << "The exhaustive search can only cut off partial trees for LQIC, with "
+                 << objectiveFunctionStr << " it scores every topology." << std::endl;
 
 
     FILE *fp = fopen(pathToOutput.c_str(), "w");
@@ -350,15 +438,17 @@ int main(int argc, char* argv[]) {
     omp_set_num_threads(numThreads);
     Random::seed(seed);
 
-    size_t m = countEvalTrees(pathToEvaluationTrees);
+    // Parse the evaluation trees once for everything this program derives from them.
+    EvalTrees evalTrees(pathToEvaluationTrees);
+    size_t m = evalTrees.size();
     if (m < (size_t(1) << 8))
-        doStuff<uint8_t>(pathToEvaluationTrees, m, startTreeMethod, algorithm, pathToOutput, pathToStartTree, restrictByLqic, cached, simannfactor, clustering, treesearchAlgorithmClustered, objectiveFunction);
+        doStuffWithObjective<uint8_t>(objectiveFunction, evalTrees, m, startTreeMethod, algorithm, pathToOutput, pathToStartTree, restrictByLqic, simannfactor, clustering, treesearchAlgorithmClustered, restarts, seed, pathToSaveQuartets, pathToLoadQuartets, stepwiseOrders, stepwiseMargin, sprRadius, temperingChains);
     else if (m < (size_t(1) << 16))
-        doStuff<uint16_t>(pathToEvaluationTrees, m, startTreeMethod, algorithm, pathToOutput, pathToStartTree, restrictByLqic, cached, simannfactor, clustering, treesearchAlgorithmClustered, objectiveFunction);
+        doStuffWithObjective<uint16_t>(objectiveFunction, evalTrees, m, startTreeMethod, algorithm, pathToOutput, pathToStartTree, restrictByLqic, simannfactor, clustering, treesearchAlgorithmClustered, restarts, seed, pathToSaveQuartets, pathToLoadQuartets, stepwiseOrders, stepwiseMargin, sprRadius, temperingChains);
     else if (m < (size_t(1) << 32))
-        doStuff<uint32_t>(pathToEvaluationTrees, m, startTreeMethod, algorithm, pathToOutput, pathToStartTree, restrictByLqic, cached, simannfactor, clustering, treesearchAlgorithmClustered, objectiveFunction);
+        doStuffWithObjective<uint32_t>(objectiveFunction, evalTrees, m, startTreeMethod, algorithm, pathToOutput, pathToStartTree, restrictByLqic, simannfactor, clustering, treesearchAlgorithmClustered, restarts, seed, pathToSaveQuartets, pathToLoadQuartets, stepwiseOrders, stepwiseMargin, sprRadius, temperingChains);
     else
-        doStuff<uint64_t>(pathToEvaluationTrees, m, startTreeMethod, algorithm, pathToOutput, pathToStartTree, restrictByLqic, cached, simannfactor, clustering, treesearchAlgorithmClustered, objectiveFunction);
+        doStuffWithObjective<uint64_t>(objectiveFunction, evalTrees, m, startTreeMethod, algorithm, pathToOutput, pathToStartTree, restrictByLqic, simannfactor, clustering, treesearchAlgorithmClustered, restarts, seed, pathToSaveQuartets, pathToLoadQuartets, stepwiseOrders, stepwiseMargin, sprRadius, temperingChains);
 
     LOG_BOLD << "Done" << std::endl;
 
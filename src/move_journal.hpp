@@ -0,0 +1,106 @@
+#ifndef MOVE_JOURNAL_HPP
+#define MOVE_JOURNAL_HPP
+
+#include "nni.hpp"
+#include "spr.hpp"
+#include "compact_tree.hpp"
+#include "score_delta.hpp"
+
+enum MoveType { MOVE_NNI_A, MOVE_NNI_B, MOVE_SPR };
+
+// A topology move: the NNI edge, or the prune and regraft edge of an SPR.
+struct Move {
+    MoveType type;
+    size_t first;
+    size_t second;
+};
+
+inline Move nni_move(NniVariant variant, size_t e) { return { variant == NNI_A ? MOVE_NNI_A : MOVE_NNI_B, e, 0 }; }
+inline Move spr_move(size_t pruneEdgeIdx, size_t regraftEdgeIdx) { return { MOVE_SPR, pruneEdgeIdx, regraftEdgeIdx }; }
+
+// Applies the move to the topology only; scores are left alone. Every move is its own inverse.
+void apply_move(Tree& tree, const Move& move) {
+    switch (move.type) {
+    case MOVE_NNI_A: nni_a_inplace(tree, move.first); break;
+    case MOVE_NNI_B: nni_b_inplace(tree, move.first); break;
+    case MOVE_SPR: spr(tree, move.first, move.second); break;
+    }
+}
+
+void apply_move(CompactTree& tree, const Move& move) {
+    switch (move.type) {
+    case MOVE_NNI_A: tree.nni_a(move.first); break;
+    case MOVE_NNI_B: tree.nni_b(move.first); break;
+    case MOVE_SPR: tree.spr(move.first, move.second); break;
+    }
+}
+
+// Moves applied to a tree since some reference state, e.g. the best tree seen so far. undo() takes
+// the tree back to an earlier position, replay() applies recorded moves to a copy of the reference.
+class MoveJournal {
+public:
+    void record(const Move& move) { moves.push_back(move); }
+    size_t size() const { return moves.size(); }
+    void clear() { moves.clear(); }
+
+    // Takes tree, which has all recorded moves applied, back to the state after the first n moves.
+    template<typename TREE>
+    void undo(TREE& tree, size_t n = 0) {
+        while (moves.size() > n) {
+            apply_move(tree, moves.back());
+            moves.pop_back();
+        }
+    }
+
+    // Applies the recorded moves [from, to) to tree.
+    template<typename TREE>
+    void replay(TREE& tree, size_t from, size_t to) const {
+        for (size_t i = from; i < to; ++i) apply_move(tree, moves[i]);
+    }
+
+private:
+    std::vector<Move> moves;
+};
+
+// The best tree of a random walk, kept as the accepted moves since the walk left it. Rebuilding it
+// at the end is cheaper than copying the tree on every improvement, but a walk that stays away
+// from the best tree would grow the journal without bound. Once it holds cap moves, the best tree
+// is rebuilt as a copy and later moves are no longer recorded until the next improvement.
+template<typename TREE>
+class BestTreeJournal {
+public:
+    explicit BestTreeJournal(size_t _cap) : cap(_cap), copied(false) {}
+
+    // The current tree is the new best.
+    void clear() {
+        journal.clear();
+        copied = false;
+    }
+
+    // move has been applied to current and accepted.
+    void record(const TREE& current, const Move& move) {
+        if (copied) return;
+        journal.record(move);
+        if (journal.size() < cap) return;
+        best = current;
+        journal.undo(best);
+        copied = true;
+    }
+
+    size_t size() const { return journal.size(); }
+
+    // Turns current, the tree all recorded moves were applied to, back into the best tree.
+    void undo(TREE& current) {
+        if (copied) current = best;
+        else journal.undo(current);
+        clear();
+    }
+
+private:
+    size_t cap;
+    MoveJournal journal;
+    bool copied;
+    TREE best;
+};
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef MOVE_PROPOSER_HPP
+#define MOVE_PROPOSER_HPP
+
+#include "objective_function.hpp"
+#include "nni.hpp"
+#include "spr.hpp"
+#include "move_journal.hpp"
+#include "random.hpp"
+
+// Draws indices proportional to non-negative weights that change one at a time. A Fenwick tree
+// over the weights makes an update and a draw O(log n) each.
+class WeightedSampler {
+public:
+    explicit WeightedSampler(size_t n = 0) : w(n, 0), fenwick(n + 1, 0), total_(0) {}
+
+    size_t size() const { return w.size(); }
+    double weight(size_t i) const { return w[i]; }
+    double total() const { return total_; }
+
+    void set(size_t i, double x) {
+        const double d = x - w[i];
+        w[i] = x;
+        total_ += d;
+        for (size_t j = i + 1; j < fenwick.size(); j += j & (~j + 1)) fenwick[j] += d;
+    }
+
+    // Index i with w[0] + ... + w[i-1] <= u < w[0] + ... + w[i], for u in [0, total()).
+    size_t draw(double u) const {
+        size_t step = 1;
+        while (step * 2 < fenwick.size()) step *= 2;
+        size_t pos = 0;
+        for (; step > 0; step /= 2) {
+            if (pos + step < fenwick.size() and fenwick[pos + step] <= u) {
+                pos += step;
+                u -= fenwick[pos];
+            }
+        }
+        return std::min(pos, w.size() - 1);
+    }
+
+    // Sums the weights afresh, dropping the rounding error of many updates.
+    void rebuild() {
+        std::fill(fenwick.begin(), fenwick.end(), 0);
+        total_ = 0;
+        for (size_t i = 0; i < w.size(); ++i) {
+            total_ += w[i];
+            for (size_t j = i + 1; j < fenwick.size(); j += j & (~j + 1)) fenwick[j] += w[i];
+        }
+    }
+
+private:
+    std::vector<double> w;
+    std::vector<double> fenwick;
+    double total_;
+};
+
+enum ProposalType { PROPOSE_NNI, PROPOSE_SPR_NEAR, PROPOSE_SPR_FAR, PROPOSAL_TYPES };
+
+// Random moves for the annealers, drawn from a distribution that adapts to what gets accepted.
+// The move type is chosen in proportion to its recent acceptance and improvement rates (decayed
+// counts, starting from the former 80% NNI / 20% SPR split). The edge is chosen in proportion to a
+// weight that is higher for edges with a negative score and for edges whose moves were accepted
+// before. NNI edges are drawn from a second sampler that holds the same weights for inner edges
+// and zero for leaf edges, so no draw is wasted on an edge without an NNI. An SPR regraft edge is
+// reached by a random walk of the drawn length from the prune point, away from the pruned subtree,
+// so every pair drawn is valid.
+template<typename CINT, typename Objective = Functions<CINT> >
+class MoveProposer {
+public:
+    MoveProposer(const Tree& tree, TreeScores<CINT>& _qsc, const Objective& _functions);
+
+    // Applies a random move to tree in place and updates qsc and objective_sum. Returns the move,
+    // so it can be undone together with objective_sum.revert().
+    Move propose(Tree& tree, ObjectiveSum<CINT, Objective>& objective_sum);
+    // To be called once the last proposal was accepted or undone.
+    void feedback(bool accepted, bool improved, const ObjectiveSum<CINT, Objective>& objective_sum);
+    // Re-reads the weights of the edges the last move touched.
+    void update_weights(const ObjectiveSum<CINT, Objective>& objective_sum);
+
+    double type_probability(ProposalType type) const { return type_weight(type) / total_type_weight(); }
+
+private:
+    TreeScores<CINT>& qsc;
+    const Objective& functions;
+    WeightedSampler edges;
+    WeightedSampler inner_edges;
+    std::vector<char> inner;
+    std::vector<float> edge_proposed;
+    std::vector<float> edge_accepted;
+    double proposed[PROPOSAL_TYPES];
+    double accepted[PROPOSAL_TYPES];
+    double improved[PROPOSAL_TYPES];
+    ProposalType last_type;
+    size_t last_edge;
+    // Edges the last move gave new secondary ends and whether they were inner edges before it, to
+    // restore after a rejected move, which is undone on the tree without the proposer.
+    size_t reconnected[4];
+    char was_inner[4];
+    size_t reconnected_count;
+    size_t draws;
+
+    static constexpr double NEGATIVE_BIAS = 4;
+    static constexpr double DECAY = 0.999;
+    static constexpr double MIN_TYPE_RATE = 0.05;
+    static const size_t FAR_RADIUS = 10;
+
+    double edge_weight(size_t e) const;
+    double type_weight(ProposalType type) const;
+    double total_type_weight() const;
+    ProposalType draw_type() const;
+    size_t draw_edge() const { return edges.draw(Random::get_rand_float(0, edges.total())); }
+    size_t draw_inner_edge() const;
+    void set_weight(size_t e);
+    void update_inner(const Tree& tree);
+    bool walk(const Tree& tree, size_t p, size_t length, size_t& r) const;
+};
+
+template<typename CINT, typename Objective>
+MoveProposer<CINT, Objective>::MoveProposer(const Tree& tree, TreeScores<CINT>& _qsc, const Objective& _functions)
+    : qsc(_qsc), functions(_functions), edges(tree.edge_count()), inner_edges(tree.edge_count()),
+      inner(tree.edge_count()), edge_proposed(tree.edge_count(), 0), edge_accepted(tree.edge_count(), 0),
+      last_type(PROPOSE_NNI), last_edge(0), reconnected_count(0), draws(0) {
+    // The prior: 80% NNI, 20% SPR, worth a few dozen proposals.
+    const double prior[PROPOSAL_TYPES] = { 0.8, 0.1, 0.1 };
+    for (size_t t = 0; t < PROPOSAL_TYPES; ++t) {
+        proposed[t] = 50;
+        accepted[t] = 50 * prior[t];
+        improved[t] = 0;
+    }
+    // Moves keep the number of inner edges, so a tree with one can always make an NNI.
+    bool any_inner = false;
+    for (size_t e = 0; e < tree.edge_count(); ++e) {
+        inner[e] = !tree.edge_at(e).secondary_link().node().is_leaf();
+        any_inner |= inner[e];
+        set_weight(e);
+    }
+    if (!any_inner) throw std::runtime_error("No moves on a tree without inner edges");
+}
+
+template<typename CINT, typename Objective>
+void MoveProposer<CINT, Objective>::set_weight(size_t e) {
+    const double w = edge_weight(e);
+    edges.set(e, w);
+    inner_edges.set(e, inner[e] ? w : 0);
+}
+
+// Re-reads which of the reconnected edges are inner edges, once the move is applied.
+template<typename CINT, typename Objective>
+void MoveProposer<CINT, Objective>::update_inner(const Tree& tree) {
+    for (size_t i = 0; i < reconnected_count; ++i) {
+        const size_t e = reconnected[i];
+        was_inner[i] = inner[e];
+        inner[e] = !tree.edge_at(e).secondary_link().node().is_leaf();
+        set_weight(e);
+    }
+}
+
+// A draw at the very top of the range, after rounding, can land past the last inner edge; it goes
+// to the inner edge below.
+template<typename CINT, typename Objective>
+size_t MoveProposer<CINT, Objective>::draw_inner_edge() const {
+    size_t e = inner_edges.draw(Random::get_rand_float(0, inner_edges.total()));
+    while (!inner[e]) e = (e == 0) ? inner.size() - 1 : e - 1;
+    return e;
+}
+
+template<typename CINT, typename Objective>
+double MoveProposer<CINT, Objective>::edge_weight(size_t e) const {
+    const double s = functions.getScore(qsc, e);
+    const double bias = (s < 0 and s >= -1) ? NEGATIVE_BIAS : 1;
+    return bias * (edge_accepted[e] + 1) / (edge_proposed[e] + 2);
+}
+
+template<typename CINT, typename Objective>
+double MoveProposer<CINT, Objective>::type_weight(ProposalType type) const {
+    const double rate = (accepted[type] + improved[type]) / proposed[type];
+    return rate > MIN_TYPE_RATE ? rate : MIN_TYPE_RATE;
+}
+
+template<typename CINT, typename Objective>
+double MoveProposer<CINT, Objective>::total_type_weight() const {
+    double sum = 0;
+    for (size_t t = 0; t < PROPOSAL_TYPES; ++t) sum += type_weight((ProposalType)t);
+    return sum;
+}
+
+template<typename CINT, typename Objective>
+ProposalType MoveProposer<CINT, Objective>::draw_type() const {
+    double u = Random::get_rand_float(0, total_type_weight());
+    for (size_t t = 0; t + 1 < PROPOSAL_TYPES; ++t) {
+        if (u < type_weight((ProposalType)t)) return (ProposalType)t;
+        u -= type_weight((ProposalType)t);
+    }
+    return (ProposalType)(PROPOSAL_TYPES - 1);
+}
+
+// Walks up to length edges from the prune point of p, never back and never into the pruned
+// subtree. The first step leaves through one of the two edges next to p, which are not valid
+// regraft edges themselves. False if both of them end in a leaf.
+template<typename CINT, typename Objective>
+bool MoveProposer<CINT, Objective>::walk(const Tree& tree, size_t p, size_t length, size_t& r) const {
+    const TreeLink& prune = tree.edge_at(p).primary_link();
+    const TreeLink* l = Random::get_rand_int(0, 1) ? &prune.next() : &prune.next().next();
+    if (l->outer().node().is_leaf()) l = (l == &prune.next()) ? &prune.next().next() : &prune.next();
+    if (l->outer().node().is_leaf()) return false;
+
+    for (size_t step = 0; step < length; ++step) {
+        const TreeLink& o = l->outer();
+        if (o.node().is_leaf()) break;
+        l = Random::get_rand_int(0, 1) ? &o.next() : &o.next().next();
+    }
+    r = l->edge().index();
+    return true;
+}
+
+template<typename CINT, typename Objective>
+Move MoveProposer<CINT, Objective>::propose(Tree& tree, ObjectiveSum<CINT, Objective>& objective_sum) {
+    last_type = draw_type();
+    if (last_type != PROPOSE_NNI) {
+        const size_t p = draw_edge();
+        const size_t length = (last_type == PROPOSE_SPR_NEAR) ? Random::get_rand_int(1, 2) : Random::get_rand_int(3, FAR_RADIUS);
+        size_t r;
+        if (walk(tree, p, length, r)) {
+            last_edge = p;
+            // An SPR gives new secondary ends to the edges at the prune point and the regraft edge,
+            // so these are the ones that can turn from inner into leaf edges or back.
+            const TreeLink& prune = tree.edge_at(p).primary_link();
+            reconnected[0] = prune.next().edge().index();
+            reconnected[1] = prune.next().next().edge().index();
+            reconnected[2] = r;
+            reconnected_count = 3;
+            spr(tree, p, r);
+            functions.spr_score_update(tree, p, r, qsc);
+            objective_sum.spr_update(tree, p, r);
+            update_inner(tree);
+            return spr_move(p, r);
+        }
+        last_type = PROPOSE_NNI;
+    }
+
+    const size_t e = draw_inner_edge();
+    last_edge = e;
+    // An NNI swaps the subtrees behind the four edges around e, which keep their places at e's ends.
+    const TreeLink& p = tree.edge_at(e).primary_link();
+    const TreeLink& s = tree.edge_at(e).secondary_link();
+    reconnected[0] = p.next().edge().index();
+    reconnected[1] = p.next().next().edge().index();
+    reconnected[2] = s.next().edge().index();
+    reconnected[3] = s.next().next().edge().index();
+    reconnected_count = 4;
+    const int ab = Random::get_rand_int(0, 1);
+    if (ab == 0)
+        functions.nni_a(tree, e, qsc);
+    else
+        functions.nni_b(tree, e, qsc);
+    objective_sum.nni_update(tree, e);
+    update_inner(tree);
+    return nni_move(ab == 0 ? NNI_A : NNI_B, e);
+}
+
+template<typename CINT, typename Objective>
+void MoveProposer<CINT, Objective>::feedback(bool was_accepted, bool was_improved, const ObjectiveSum<CINT, Objective>& objective_sum) {
+    for (size_t t = 0; t < PROPOSAL_TYPES; ++t) {
+        proposed[t] *= DECAY;
+        accepted[t] *= DECAY;
+        improved[t] *= DECAY;
+    }
+    proposed[last_type] += 1;
+    if (was_accepted) accepted[last_type] += 1;
+    if (was_improved) improved[last_type] += 1;
+
+    if (!was_accepted) {
+        for (size_t i = reconnected_count; i-- > 0; ) {
+            inner[reconnected[i]] = was_inner[i];
+            set_weight(reconnected[i]);
+        }
+    }
+    edge_proposed[last_edge] += 1;
+    if (was_accepted) edge_accepted[last_edge] += 1;
+    set_weight(last_edge);
+    update_weights(objective_sum);
+}
+
+template<typename CINT, typename Objective>
+void MoveProposer<CINT, Objective>::update_weights(const ObjectiveSum<CINT, Objective>& objective_sum) {
+    for (size_t e : objective_sum.last_touched()) set_weight(e);
+    if (++draws % (16 * edges.size()) == 0) {
+        edges.rebuild();
+        inner_edges.rebuild();
+    }
+}
+
+#endif
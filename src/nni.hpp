@@ -16,10 +16,11 @@ Tree nni_b(Tree& tree, int i);
 void nni_b_inplace(Tree& tree, int i);
 void nni_a_inplace(Tree& tree, int i);
 Tree make_random_nni_moves(Tree& tree, int n);
-template<typename CINT> void nni_a_with_lqic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc);
-template<typename CINT> void nni_b_with_lqic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc);
-template<typename CINT> void nni_a_with_qpic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc);
-template<typename CINT> void nni_b_with_qpic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc);
+void nni_neighbourhood(const Tree& tree, size_t e, std::vector<size_t>& edges);
+template<typename CINT> void nni_a_with_lqic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc);
+template<typename CINT> void nni_b_with_lqic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc);
+template<typename CINT> void nni_a_with_qpic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc);
+template<typename CINT> void nni_b_with_qpic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc);
 // -----------------------------
 
 
@@ -46,9 +47,9 @@ template<typename CINT>
 GENERATOR(nni_generator_qsc) {
     size_t i;
     Tree tree;
-    QuartetScoreComputer<CINT>* qsc;
+    TreeScores<CINT>* qsc;
     bool restrict_by_lqic;
-    nni_generator_qsc(Tree t, QuartetScoreComputer<CINT>* _qsc, bool _restrict_by_lqic = false) { tree = t; qsc = _qsc; restrict_by_lqic = _restrict_by_lqic; }
+    nni_generator_qsc(Tree t, TreeScores<CINT>* _qsc, bool _restrict_by_lqic = false) { tree = t; qsc = _qsc; restrict_by_lqic = _restrict_by_lqic; }
     EMIT(Tree)
         for (i = 0; i < tree.edge_count(); i++){
             if (!(tree.edge_at(i).primary_link().node().is_inner() && tree.edge_at(i).secondary_link().node().is_inner()))
@@ -116,15 +117,29 @@ Tree nni_a(Tree& tree, int i) {
     return tnew;
 }
 
+// Edge e and the four edges adjacent to it, the edges the incremental NNI updates write. The QPIC
+// and EQPIC updates rescore all five. The LQIC update rescores e and swaps the values of the two
+// reattached neighbours, so their LQIC is carried over rather than recomputed for their new
+// quadripartitions.
+void nni_neighbourhood(const Tree& tree, size_t e, std::vector<size_t>& edges) {
+    const TreeEdge& edge = tree.edge_at(e);
+    edges.clear();
+    edges.push_back(e);
+    edges.push_back(edge.primary_link().next().edge().index());
+    edges.push_back(edge.primary_link().next().next().edge().index());
+    edges.push_back(edge.secondary_link().next().edge().index());
+    edges.push_back(edge.secondary_link().next().next().edge().index());
+}
+
 template<typename CINT>
-void swap_LQIC(size_t i, size_t j, QuartetScoreComputer<CINT>& qsc) {
+void swap_LQIC(size_t i, size_t j, TreeScores<CINT>& qsc) {
     double t = qsc.getLQICScores()[i];
     qsc.setLQIC(i, qsc.getLQICScores()[j]);
     qsc.setLQIC(j, t);
 }
 
 template<typename CINT>
-void nni_a_with_lqic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc) {
+void nni_a_with_lqic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc) {
     bool case1 =
         tree.edge_at(e).primary_link().next().edge().secondary_link().index() ==
         tree.edge_at(e).primary_link().next().index();
@@ -141,7 +156,7 @@ void nni_a_with_lqic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qs
 
 
 template<typename CINT>
-void nni_b_with_lqic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc) {
+void nni_b_with_lqic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc) {
     bool case1 =
         tree.edge_at(e).primary_link().next().edge().secondary_link().index() ==
         tree.edge_at(e).primary_link().next().index();
@@ -158,7 +173,7 @@ void nni_b_with_lqic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qs
 }
 
 template<typename CINT>
-void nni_a_with_qpic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc) {
+void nni_a_with_qpic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc) {
     nni_a_inplace(tree, e);
     qsc.recomputeQpicForEdge(tree, e);
     qsc.recomputeQpicForEdge(tree, tree.edge_at(e).primary_link().next().edge().index());
@@ -168,7 +183,7 @@ void nni_a_with_qpic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qs
 }
 
 template<typename CINT>
-void nni_b_with_qpic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc) {
+void nni_b_with_qpic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc) {
     nni_b_inplace(tree, e);
     qsc.recomputeQpicForEdge(tree, e);
     qsc.recomputeQpicForEdge(tree, tree.edge_at(e).primary_link().next().edge().index());
@@ -178,27 +193,23 @@ void nni_b_with_qpic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qs
 }
 
 template<typename CINT>
-void nni_a_with_eqpic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc) {
+void nni_a_with_eqpic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc) {
     nni_a_inplace(tree, e);
-
-    qsc.recomputeEqpicForEdge(tree, 0);
-    for (size_t e = 1; e < tree.edge_count(); ++e) {
-        qsc.recomputeEqpicForEdge(e);
-    }
-
-    TODO( Too many unnecessary edges get recomputed)
+    qsc.recomputeEqpicForEdge(tree, e);
+    qsc.recomputeEqpicForEdge(tree, tree.edge_at(e).primary_link().next().edge().index());
+    qsc.recomputeEqpicForEdge(tree, tree.edge_at(e).primary_link().next().next().edge().index());
+    qsc.recomputeEqpicForEdge(tree, tree.edge_at(e).secondary_link().next().edge().index());
+    qsc.recomputeEqpicForEdge(tree, tree.edge_at(e).secondary_link().next().next().edge().index());
 }
 
 template<typename CINT>
-void nni_b_with_eqpic_update(Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc) {
+void nni_b_with_eqpic_update(Tree& tree, size_t e, TreeScores<CINT>& qsc) {
     nni_b_inplace(tree, e);
-    
-    qsc.recomputeEqpicForEdge(tree, 0);
-    for (size_t e = 1; e < tree.edge_count(); ++e) {
-        qsc.recomputeEqpicForEdge(e);
-    }
-
-    TODO( Too many unnecessary edges get recomputed)
+    qsc.recomputeEqpicForEdge(tree, e);
+    qsc.recomputeEqpicForEdge(tree, tree.edge_at(e).primary_link().next().edge().index());
+    qsc.recomputeEqpicForEdge(tree, tree.edge_at(e).primary_link().next().next().edge().index());
+    qsc.recomputeEqpicForEdge(tree, tree.edge_at(e).secondary_link().next().edge().index());
+    qsc.recomputeEqpicForEdge(tree, tree.edge_at(e).secondary_link().next().next().edge().index());
 }
 
 void nni_a_inplace(Tree& tree, int i) {
@@ -1,12 +1,11 @@
 #ifndef OBJECTIVE_FUNCTION_HPP
 #define OBJECTIVE_FUNCTION_HPP
 
-
-enum ObjectiveFunction { LQIC, QPIC, EQPIC };
+#include "tree_scores.hpp"
 
 template<typename CINT>
-double sum_lqic_scores(QuartetScoreComputer<CINT>& qsc) {
-    std::vector<double> lqic = qsc.getLQICScores();
+double sum_lqic_scores(const TreeScores<CINT>& qsc) {
+    const std::vector<double>& lqic = qsc.getLQICScores();
     double sum = 0;
     for (size_t j = 0; j < lqic.size(); ++j)
         if (lqic[j] <= 1 && lqic[j] >= -1) sum += lqic[j];
@@ -14,8 +13,8 @@ double sum_lqic_scores(QuartetScoreComputer<CINT>& qsc) {
 }
 
 template<typename CINT>
-double mean_lqic_scores(QuartetScoreComputer<CINT>& qsc) {
-    std::vector<double> lqic = qsc.getLQICScores();
+double mean_lqic_scores(const TreeScores<CINT>& qsc) {
+    const std::vector<double>& lqic = qsc.getLQICScores();
     double sum = 0;
     int N = 0;
     for (size_t j = 0; j < lqic.size(); ++j)
@@ -24,8 +23,8 @@ double mean_lqic_scores(QuartetScoreComputer<CINT>& qsc) {
 }
 
 template<typename CINT>
-double sum_qpic_scores(QuartetScoreComputer<CINT>& qsc) {
-    std::vector<double> qpic = qsc.getQPICScores();
+double sum_qpic_scores(const TreeScores<CINT>& qsc) {
+    const std::vector<double>& qpic = qsc.getQPICScores();
     double sum = 0;
     for (size_t j = 0; j < qpic.size(); ++j)
         if (qpic[j] <= 1 && qpic[j] >= -1) sum += qpic[j];
@@ -33,8 +32,8 @@ double sum_qpic_scores(QuartetScoreComputer<CINT>& qsc) {
 }
 
 template<typename CINT>
-double mean_qpic_scores(QuartetScoreComputer<CINT>& qsc) {
-    std::vector<double> qpic = qsc.getQPICScores();
+double mean_qpic_scores(const TreeScores<CINT>& qsc) {
+    const std::vector<double>& qpic = qsc.getQPICScores();
     double sum = 0;
     int N = 0;
     for (size_t j = 0; j < qpic.size(); ++j)
@@ -43,8 +42,8 @@ double mean_qpic_scores(QuartetScoreComputer<CINT>& qsc) {
 }
 
 template<typename CINT>
-double sum_eqpic_scores(QuartetScoreComputer<CINT>& qsc) {
-    std::vector<double> eqpic = qsc.getEQPICScores();
+double sum_eqpic_scores(const TreeScores<CINT>& qsc) {
+    const std::vector<double>& eqpic = qsc.getEQPICScores();
     double sum = 0;
     for (size_t j = 0; j < eqpic.size(); ++j)
         if (eqpic[j] <= 1 && eqpic[j] >= -1) sum += eqpic[j];
@@ -52,8 +51,8 @@ double sum_eqpic_scores(QuartetScoreComputer<CINT>& qsc) {
 }
 
 template<typename CINT>
-double mean_eqpic_scores(QuartetScoreComputer<CINT>& qsc) {
-    std::vector<double> eqpic = qsc.getEQPICScores();
+double mean_eqpic_scores(const TreeScores<CINT>& qsc) {
+    const std::vector<double>& eqpic = qsc.getEQPICScores();
     double sum = 0;
     int N = 0;
     for (size_t j = 0; j < eqpic.size(); ++j)
@@ -61,76 +60,199 @@ double mean_eqpic_scores(QuartetScoreComputer<CINT>& qsc) {
     return sum/N;
 }
 
+// Compile-time objective policies. The searches are templates on them, so the per-move calls in
+// their inner loops are direct calls the compiler can inline. main instantiates them once, next to
+// the choice of CINT.
+template<typename CINT>
+struct LqicObjective {
+    static constexpr ObjectiveFunction id = LQIC;
+
+    static double obj_fun(TreeScores<CINT>& qsc) { return sum_lqic_scores(qsc); }
+    static void nni_a(Tree& tree, size_t e, TreeScores<CINT>& qsc) { nni_a_with_lqic_update(tree, e, qsc); }
+    static void nni_b(Tree& tree, size_t e, TreeScores<CINT>& qsc) { nni_b_with_lqic_update(tree, e, qsc); }
+    static void spr_score_update(Tree& tree, size_t p, size_t r, TreeScores<CINT>& qsc) { spr_lqic_update(tree, p, r, qsc); }
+    static bool nni_restrict_edge(Tree& tree, size_t e, TreeScores<CINT>& qsc, bool restricted) {
+        (void)tree;
+        return restricted and qsc.getLQICScores()[e] > 0;
+    }
+    static bool spr_restrict_edgepair(Tree& tree, size_t p, size_t r, TreeScores<CINT>& qsc, bool restricted) {
+        return restricted and !has_negative_lqic_on_spr_path(tree, p, r, qsc.getLQICScores());
+    }
+    static const std::vector<double>& getScores(const TreeScores<CINT>& qsc) { return qsc.getLQICScores(); }
+    static double getScore(const TreeScores<CINT>& qsc, size_t e) { return qsc.getLQICScores()[e]; }
+    static void setScore(TreeScores<CINT>& qsc, size_t e, double val) { qsc.setLQIC(e, val); }
+    // Edges whose score nni_a/nni_b and spr_score_update can change.
+    static void nni_touched(const Tree& tree, size_t e, std::vector<size_t>& edges) { nni_neighbourhood(tree, e, edges); }
+    static void spr_touched(const Tree& tree, size_t p, size_t r, std::vector<size_t>& edges) { spr_lqic_path(tree, p, r, edges); }
+};
+
+template<typename CINT>
+struct QpicObjective {
+    static constexpr ObjectiveFunction id = QPIC;
+
+    static double obj_fun(TreeScores<CINT>& qsc) { return sum_qpic_scores(qsc); }
+    static void nni_a(Tree& tree, size_t e, TreeScores<CINT>& qsc) { nni_a_with_qpic_update(tree, e, qsc); }
+    static void nni_b(Tree& tree, size_t e, TreeScores<CINT>& qsc) { nni_b_with_qpic_update(tree, e, qsc); }
+    static void spr_score_update(Tree& tree, size_t p, size_t r, TreeScores<CINT>& qsc) { spr_qpic_update(tree, p, r, qsc); }
+    static bool nni_restrict_edge(Tree& tree, size_t e, TreeScores<CINT>& qsc, bool restricted) {
+        TODO(Restrict Edges for QPIC)
+        (void)tree; (void)e; (void)qsc; (void)restricted;
+        return false;
+    }
+    static bool spr_restrict_edgepair(Tree& tree, size_t p, size_t r, TreeScores<CINT>& qsc, bool restricted) {
+        (void)tree; (void)p; (void)r; (void)qsc; (void)restricted;
+        return false;
+    }
+    static const std::vector<double>& getScores(const TreeScores<CINT>& qsc) { return qsc.getQPICScores(); }
+    static double getScore(const TreeScores<CINT>& qsc, size_t e) { return qsc.getQPICScores()[e]; }
+    static void setScore(TreeScores<CINT>& qsc, size_t e, double val) { qsc.setQPIC(e, val); }
+    static void nni_touched(const Tree& tree, size_t e, std::vector<size_t>& edges) { nni_neighbourhood(tree, e, edges); }
+    static void spr_touched(const Tree& tree, size_t p, size_t r, std::vector<size_t>& edges) { spr_qpic_edges(tree, p, r, edges); }
+};
+
+template<typename CINT>
+struct EqpicObjective {
+    static constexpr ObjectiveFunction id = EQPIC;
+
+    static double obj_fun(TreeScores<CINT>& qsc) { return sum_eqpic_scores(qsc); }
+    static void nni_a(Tree& tree, size_t e, TreeScores<CINT>& qsc) { nni_a_with_eqpic_update(tree, e, qsc); }
+    static void nni_b(Tree& tree, size_t e, TreeScores<CINT>& qsc) { nni_b_with_eqpic_update(tree, e, qsc); }
+    static void spr_score_update(Tree& tree, size_t p, size_t r, TreeScores<CINT>& qsc) { spr_eqpic_update(tree, p, r, qsc); }
+    static bool nni_restrict_edge(Tree& tree, size_t e, TreeScores<CINT>& qsc, bool restricted) {
+        TODO(Restrict Edges for EQPIC)
+        (void)tree; (void)e; (void)qsc; (void)restricted;
+        return false;
+    }
+    static bool spr_restrict_edgepair(Tree& tree, size_t p, size_t r, TreeScores<CINT>& qsc, bool restricted) {
+        (void)tree; (void)p; (void)r; (void)qsc; (void)restricted;
+        return false;
+    }
+    static const std::vector<double>& getScores(const TreeScores<CINT>& qsc) { return qsc.getEQPICScores(); }
+    static double getScore(const TreeScores<CINT>& qsc, size_t e) { return qsc.getEQPICScores()[e]; }
+    static void setScore(TreeScores<CINT>& qsc, size_t e, double val) { qsc.setEQPIC(e, val); }
+    static void nni_touched(const Tree& tree, size_t e, std::vector<size_t>& edges) { nni_neighbourhood(tree, e, edges); }
+    static void spr_touched(const Tree& tree, size_t p, size_t r, std::vector<size_t>& edges) { spr_lqic_path(tree, p, r, edges); }
+};
+
+template<typename CINT> constexpr ObjectiveFunction LqicObjective<CINT>::id;
+template<typename CINT> constexpr ObjectiveFunction QpicObjective<CINT>::id;
+template<typename CINT> constexpr ObjectiveFunction EqpicObjective<CINT>::id;
+
+// The same calls chosen at runtime, through function pointers, for code that only knows the
+// ObjectiveFunction value. Usable wherever a policy is.
 template<typename CINT>
 struct Functions {
-    double (*obj_fun)(QuartetScoreComputer<CINT>&);
-    void (*nni_a)(Tree&, size_t, QuartetScoreComputer<CINT>&);
-    void (*nni_b)(Tree&, size_t, QuartetScoreComputer<CINT>&);
-    void (*spr_score_update)(Tree&, size_t, size_t, QuartetScoreComputer<CINT>&);
-    bool (*nni_restrict_edge)(Tree&, size_t, QuartetScoreComputer<CINT>&, bool);
-    bool (*spr_restrict_edgepair)(Tree&, size_t, size_t, QuartetScoreComputer<CINT>&, bool);
-    std::vector<double> (*getScores)(QuartetScoreComputer<CINT>&);
-    void (*setScore)(QuartetScoreComputer<CINT>&, size_t, double);
+    ObjectiveFunction id;
+    double (*obj_fun)(TreeScores<CINT>&);
+    void (*nni_a)(Tree&, size_t, TreeScores<CINT>&);
+    void (*nni_b)(Tree&, size_t, TreeScores<CINT>&);
+    void (*spr_score_update)(Tree&, size_t, size_t, TreeScores<CINT>&);
+    bool (*nni_restrict_edge)(Tree&, size_t, TreeScores<CINT>&, bool);
+    bool (*spr_restrict_edgepair)(Tree&, size_t, size_t, TreeScores<CINT>&, bool);
+    const std::vector<double>& (*getScores)(const TreeScores<CINT>&);
+    double (*getScore)(const TreeScores<CINT>&, size_t);
+    void (*setScore)(TreeScores<CINT>&, size_t, double);
+    void (*nni_touched)(const Tree&, size_t, std::vector<size_t>&);
+    void (*spr_touched)(const Tree&, size_t, size_t, std::vector<size_t>&);
 
     Functions(ObjectiveFunction objective);
+
+private:
+    template<typename Objective> void assign();
 };
 
 template<typename CINT>
 Functions<CINT>::Functions(ObjectiveFunction objective) {
     switch (objective) {
-    case LQIC :
-        obj_fun = sum_lqic_scores;
-        nni_a = nni_a_with_lqic_update;
-        nni_b = nni_b_with_lqic_update;
-        spr_score_update = spr_lqic_update;
-        nni_restrict_edge = [](Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc, bool restricted) {
-            (void)tree;
-            return restricted and qsc.getLQICScores()[e] > 0; };
-        spr_restrict_edgepair =
-            [](Tree& tree, size_t p, size_t r, QuartetScoreComputer<CINT>& qsc, bool restricted) {
-            return restricted and !has_negative_lqic_on_spr_path(tree, p, r, qsc.getLQICScores()); };
-        getScores = [](QuartetScoreComputer<CINT>& qsc) { return qsc.getLQICScores(); };
-        setScore = [](QuartetScoreComputer<CINT>& qsc, size_t e, double val) { qsc.setLQIC(e, val); };
-
-        break;
-    case QPIC:
-        obj_fun = sum_qpic_scores;
-        nni_a = nni_a_with_qpic_update;
-        nni_b = nni_b_with_qpic_update;
-        spr_score_update = spr_qpic_update;
-        TODO(Restrict Edges for QPIC)
-        nni_restrict_edge = [](Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc, bool restricted) {
-            (void)tree; (void)e; (void)qsc; (void)restricted;
-            return false; };
-        spr_restrict_edgepair = 
-            [](Tree& tree, size_t p, size_t r, QuartetScoreComputer<CINT>& qsc, bool restricted) {
-            (void)tree; (void)p; (void)r; (void)qsc; (void)restricted;
-            return false; };
-        getScores = [](QuartetScoreComputer<CINT>& qsc) { return qsc.getQPICScores(); };
-        setScore = [](QuartetScoreComputer<CINT>& qsc, size_t e, double val) { qsc.setQPIC(e, val); };
-        //throw std::runtime_error("Not implemented");
-        break;
-    case EQPIC:
-        obj_fun = sum_eqpic_scores;
-        nni_a = nni_a_with_eqpic_update;
-        nni_b = nni_b_with_eqpic_update;
-        spr_score_update = spr_eqpic_update;
-        TODO(Restrict Edges for EQPIC)
-            nni_restrict_edge = [](Tree& tree, size_t e, QuartetScoreComputer<CINT>& qsc, bool restricted) {
-                                    (void)tree; (void)e; (void)qsc; (void)restricted;
-                                    return false; };
-        spr_restrict_edgepair = 
-            [](Tree& tree, size_t p, size_t r, QuartetScoreComputer<CINT>& qsc, bool restricted) {
-                (void)tree; (void)p; (void)r; (void)qsc; (void)restricted;
-                return false; };
-        getScores = [](QuartetScoreComputer<CINT>& qsc) { return qsc.getEQPICScores(); };
-        setScore = [](QuartetScoreComputer<CINT>& qsc, size_t e, double val) { qsc.setEQPIC(e, val); };
-        //throw std::runtime_error("Not implemented");
-        break;
+    case LQIC: assign<LqicObjective<CINT> >(); break;
+    case QPIC: assign<QpicObjective<CINT> >(); break;
+    case EQPIC: assign<EqpicObjective<CINT> >(); break;
     }
 }
 
+template<typename CINT>
+template<typename Objective>
+void Functions<CINT>::assign() {
+    id = Objective::id;
+    obj_fun = Objective::obj_fun;
+    nni_a = Objective::nni_a;
+    nni_b = Objective::nni_b;
+    spr_score_update = Objective::spr_score_update;
+    nni_restrict_edge = Objective::nni_restrict_edge;
+    spr_restrict_edgepair = Objective::spr_restrict_edgepair;
+    getScores = Objective::getScores;
+    getScore = Objective::getScore;
+    setScore = Objective::setScore;
+    nni_touched = Objective::nni_touched;
+    spr_touched = Objective::spr_touched;
+}
 
+// Running sum of the valid scores (in [-1,1], as in the sum_*_scores functions) of the chosen
+// objective. After a move only the edges the move touched are re-read, so an update costs
+// O(|touched|) instead of summing the whole score vector per candidate, and value() is O(1).
+// The sum is kept in fixed point, so that applying and reverting a move gives back exactly the
+// same value and a neutral move never looks like an improvement.
+template<typename CINT, typename Objective = Functions<CINT> >
+class ObjectiveSum {
+public:
+    ObjectiveSum(TreeScores<CINT>& _qsc, const Objective& _functions)
+        : qsc(_qsc), functions(_functions) { reset(); }
 
+    // Re-reads all scores, e.g. after recomputeScores.
+    void reset() {
+        scores = functions.getScores(qsc);
+        saved.reserve(scores.size());
+        sum = 0;
+        for (double s : scores) sum += fixed(s);
+    }
+
+    void update(const std::vector<size_t>& edges) {
+        saved.clear();
+        const std::vector<double>& current = functions.getScores(qsc);
+        for (size_t e : edges) {
+            const double s = current[e];
+            saved.push_back(std::make_pair(e, scores[e]));
+            sum += fixed(s) - fixed(scores[e]);
+            scores[e] = s;
+        }
+    }
+
+    // To be called after functions.nni_a/nni_b and functions.spr_score_update respectively.
+    void nni_update(const Tree& tree, size_t e) {
+        functions.nni_touched(tree, e, touched);
+        update(touched);
+    }
+    void spr_update(const Tree& tree, size_t p, size_t r) {
+        functions.spr_touched(tree, p, r, touched);
+        update(touched);
+    }
+
+    // Puts back the scores the last update replaced, in qsc as well, once its move is undone. Only
+    // the edges the move touched are written.
+    void revert() {
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            functions.setScore(qsc, it->first, it->second);
+            sum += fixed(it->second) - fixed(scores[it->first]);
+            scores[it->first] = it->second;
+        }
+        saved.clear();
+    }
+
+    double value() const { return sum / SCALE; }
+    // Edges of the last update.
+    const std::vector<size_t>& last_touched() const { return touched; }
+
+private:
+    TreeScores<CINT>& qsc;
+    const Objective& functions;
+    std::vector<double> scores;
+    std::vector<size_t> touched;
+    // Edge and score before the last update.
+    std::vector<std::pair<size_t, double> > saved;
+    int64_t sum;
+
+    static constexpr double SCALE = 1099511627776.0; // 2^40
+    static int64_t fixed(double s) { return (s <= 1 && s >= -1) ? std::llround(s * SCALE) : 0; }
+};
 
 #endif
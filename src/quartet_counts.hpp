@@ -0,0 +1,216 @@
+#ifndef QUARTET_COUNTS_HPP
+#define QUARTET_COUNTS_HPP
+
+#include <array>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eval_trees.hpp"
+
+// Layout of a saved quartet count table. The file is the header, the taxon names (each terminated
+// by '\0', padded to a multiple of 8 bytes) and the counts exactly as they are held in memory, so a
+// loaded table is used straight from the mapping. Integers are in native byte order.
+struct QuartetTableHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t cint_size;
+    uint64_t content_hash;
+    uint64_t taxon_count;
+    uint64_t names_size;
+};
+
+const char QUARTET_TABLE_MAGIC[8] = { 'U', 'Q', 'S', 'T', 'Q', 'T', 'A', 'B' };
+const uint32_t QUARTET_TABLE_VERSION = 1;
+
+// Number of evaluation trees supporting each of the three topologies of every quartet of taxa.
+// Taxa are numbered by their position in the sorted list of leaf names. The quartet {a<b<c<d} is
+// stored at 3*rank(a,b,c,d) (combinatorial number system) with the counts for ab|cd, ac|bd, ad|bc.
+// The table is only read after construction, so it can be shared between threads. It can be saved
+// and later mapped back in, instead of being counted again from the same evaluation trees.
+template<typename CINT>
+class QuartetCounts {
+public:
+    QuartetCounts(const EvalTrees &evalTrees);
+    // Maps a table written by save(). Throws if it was not counted from the same evaluation trees
+    // with the same CINT.
+    QuartetCounts(const EvalTrees &evalTrees, const std::string &tablePath);
+    QuartetCounts(const QuartetCounts&) = delete;
+    QuartetCounts& operator=(const QuartetCounts&) = delete;
+
+    void save(const std::string &tablePath) const;
+
+    const TaxonDictionary& dictionary() const { return taxa; }
+    size_t taxon_count() const { return taxa.size(); }
+    size_t taxon_id(const std::string& name) const { return taxa.id(name); }
+    const std::string& taxon_name(size_t id) const { return taxa.name(id); }
+
+    // Counts for the topologies ab|cd, ac|bd and ad|bc, in terms of the argument order.
+    std::array<CINT, 3> get(size_t a, size_t b, size_t c, size_t d) const;
+
+    // Taxon id for every leaf of the tree, indexed by node index. Inner nodes get taxon_count().
+    std::vector<size_t> node_taxa(const Tree& tree) const { return taxa.node_taxa(tree); }
+
+private:
+    TaxonDictionary taxa;
+    std::vector<std::array<uint64_t, 5> > binom;
+    std::string evalTreesPath;
+    uint64_t evalTreesHash;
+    // The counts are either owned or mapped from a saved table.
+    std::vector<CINT> counts;
+    std::shared_ptr<const void> mapping;
+    const CINT* table;
+
+    void init_taxa(const TaxonDictionary& dictionary);
+    size_t table_size() const { return 3 * binom[taxa.size()][4]; }
+
+    size_t rank(const std::array<size_t, 4>& q) const {
+        return binom[q[0]][1] + binom[q[1]][2] + binom[q[2]][3] + binom[q[3]][4];
+    }
+    static size_t slot(const std::array<size_t, 4>& q, size_t x, size_t y);
+    void add_tree(const EvalTrees& evalTrees, size_t t);
+};
+
+template<typename CINT>
+void QuartetCounts<CINT>::init_taxa(const TaxonDictionary& dictionary) {
+    taxa = dictionary;
+
+    binom.resize(taxa.size()+1);
+    for (size_t n = 0; n <= taxa.size(); ++n) {
+        binom[n][0] = 1;
+        for (size_t k = 1; k < 5; ++k)
+            binom[n][k] = (n == 0) ? 0 : binom[n-1][k-1] + binom[n-1][k];
+    }
+}
+
+template<typename CINT>
+QuartetCounts<CINT>::QuartetCounts(const EvalTrees &evalTrees) : evalTreesPath(evalTrees.path()), evalTreesHash(evalTrees.content_hash()) {
+    init_taxa(evalTrees.dictionary());
+    counts.assign(table_size(), 0);
+    // Gene trees are counted in parallel into the shared table. Two threads rarely hit the same
+    // quartet at the same time, so atomic increments are cheaper than a table per thread, which
+    // would multiply the largest allocation of the program by the thread count.
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (size_t t = 0; t < evalTrees.size(); ++t) add_tree(evalTrees, t);
+    table = counts.data();
+}
+
+template<typename CINT>
+QuartetCounts<CINT>::QuartetCounts(const EvalTrees &evalTrees, const std::string &tablePath) : evalTreesPath(evalTrees.path()), evalTreesHash(evalTrees.content_hash()) {
+    int fd = open(tablePath.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open quartet table " + tablePath);
+    struct stat st;
+    if (fstat(fd, &st) != 0 or (size_t)st.st_size < sizeof(QuartetTableHeader)) {
+        close(fd);
+        throw std::runtime_error(tablePath + " is not a quartet table");
+    }
+    const size_t size = st.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("Cannot map quartet table " + tablePath);
+    mapping = std::shared_ptr<const void>(data, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+
+    const QuartetTableHeader& header = *static_cast<const QuartetTableHeader*>(data);
+    if (std::memcmp(header.magic, QUARTET_TABLE_MAGIC, 8) != 0 or header.version != QUARTET_TABLE_VERSION)
+        throw std::runtime_error(tablePath + " is not a quartet table of version " + std::to_string(QUARTET_TABLE_VERSION));
+    if (header.cint_size != sizeof(CINT))
+        throw std::runtime_error(tablePath + " was counted with a different number of evaluation trees");
+    if (header.content_hash != evalTreesHash)
+        throw std::runtime_error(tablePath + " was counted from different evaluation trees than " + evalTreesPath);
+
+    const char* names = static_cast<const char*>(data) + sizeof(QuartetTableHeader);
+    if (sizeof(QuartetTableHeader) + header.names_size > size)
+        throw std::runtime_error(tablePath + " is truncated");
+    std::vector<std::string> names_list;
+    for (const char* p = names; names_list.size() < header.taxon_count; p += names_list.back().size() + 1) {
+        if (p >= names + header.names_size) throw std::runtime_error(tablePath + " is truncated");
+        names_list.push_back(std::string(p, strnlen(p, names + header.names_size - p)));
+    }
+    if (names_list != evalTrees.taxa())
+        throw std::runtime_error(tablePath + " has different taxa than " + evalTreesPath);
+    init_taxa(evalTrees.dictionary());
+
+    if (sizeof(QuartetTableHeader) + header.names_size + table_size() * sizeof(CINT) != size)
+        throw std::runtime_error(tablePath + " is truncated");
+    table = reinterpret_cast<const CINT*>(names + header.names_size);
+}
+
+template<typename CINT>
+void QuartetCounts<CINT>::save(const std::string &tablePath) const {
+    std::string names;
+    for (const std::string& name : taxa.names()) {
+        names += name;
+        names += '\0';
+    }
+    names.resize((names.size() + 7) / 8 * 8, '\0');
+
+    QuartetTableHeader header;
+    std::memcpy(header.magic, QUARTET_TABLE_MAGIC, 8);
+    header.version = QUARTET_TABLE_VERSION;
+    header.cint_size = sizeof(CINT);
+    header.content_hash = evalTreesHash;
+    header.taxon_count = taxa.size();
+    header.names_size = names.size();
+
+    std::ofstream out(tablePath, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(names.data(), names.size());
+    out.write(reinterpret_cast<const char*>(table), table_size() * sizeof(CINT));
+    if (!out) throw std::runtime_error("Cannot write quartet table " + tablePath);
+}
+
+template<typename CINT>
+size_t QuartetCounts<CINT>::slot(const std::array<size_t, 4>& q, size_t x, size_t y) {
+    size_t px = std::find(q.begin(), q.end(), x) - q.begin();
+    size_t py = std::find(q.begin(), q.end(), y) - q.begin();
+    if (px == 0) return py - 1;
+    if (py == 0) return px - 1;
+    // x and y are paired, so the smallest taxon is paired with the remaining position.
+    return (6 - px - py) - 1;
+}
+
+template<typename CINT>
+std::array<CINT, 3> QuartetCounts<CINT>::get(size_t a, size_t b, size_t c, size_t d) const {
+    std::array<size_t, 4> q = {{a, b, c, d}};
+    std::sort(q.begin(), q.end());
+    const CINT* base = table + 3 * rank(q);
+    return {{base[slot(q, a, b)], base[slot(q, a, c)], base[slot(q, a, d)]}};
+}
+
+template<typename CINT>
+void QuartetCounts<CINT>::add_tree(const EvalTrees& evalTrees, size_t t) {
+    std::vector<uint32_t> leaf_taxa;
+    std::vector<uint32_t> dist;
+    evalTrees.leaf_distances(t, leaf_taxa, dist);
+    const size_t k = leaf_taxa.size();
+
+    // Four point condition: the pairing with the strictly smallest distance sum is the topology.
+    for (size_t a = 0; a < k; ++a) {
+        for (size_t b = a+1; b < k; ++b) {
+            for (size_t c = b+1; c < k; ++c) {
+                for (size_t d = c+1; d < k; ++d) {
+                    size_t s1 = dist[a*k+b] + dist[c*k+d];
+                    size_t s2 = dist[a*k+c] + dist[b*k+d];
+                    size_t s3 = dist[a*k+d] + dist[b*k+c];
+                    size_t partner;
+                    if (s1 < s2 and s1 < s3) partner = b;
+                    else if (s2 < s1 and s2 < s3) partner = c;
+                    else if (s3 < s1 and s3 < s2) partner = d;
+                    else continue; // unresolved
+
+                    std::array<size_t, 4> q = {{leaf_taxa[a], leaf_taxa[b], leaf_taxa[c], leaf_taxa[d]}};
+                    std::sort(q.begin(), q.end());
+                    CINT& count = counts[3 * rank(q) + slot(q, leaf_taxa[a], leaf_taxa[partner])];
+                    #pragma omp atomic
+                    count++;
+                }
+            }
+        }
+    }
+}
+
+#endif
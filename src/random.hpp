@@ -1,44 +1,126 @@
 #ifndef RANDOM_HPP
 #define RANDOM_HPP
 
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <utility>
+
+// xoshiro256** by Blackman and Vigna: 256 bits of state and a handful of shifts, rotations and
+// multiplications per number. Meets the UniformRandomBitGenerator requirements, so it can be
+// handed to std::shuffle.
+class Xoshiro256 {
+public:
+    typedef uint64_t result_type;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    explicit Xoshiro256(uint64_t seed = 0) { this->seed(seed); }
+
+    // Fills the state from splitmix64 as the authors recommend, so that every seed, including 0,
+    // gives a well mixed state.
+    void seed(uint64_t seed) {
+        for (int i = 0; i < 4; ++i) s[i] = splitmix64(seed);
+    }
+
+    result_type operator()() {
+        const uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // Advances x and returns the next number of the splitmix64 sequence starting at x.
+    static uint64_t splitmix64(uint64_t& x) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+private:
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+// One generator per thread, so concurrent replicates do not share (or race on) random state.
 namespace {
-    std::mt19937 mt;
-    bool initialized = false;
+    thread_local Xoshiro256 engine_;
+    thread_local bool initialized = false;
 }
 
 namespace Random {
 
+    // Generator number `stream` of a seed. The pair is hashed into the seed of the generator, so
+    // neighbouring streams and seeds start far apart. Work that runs in parallel takes its index
+    // as the stream, which makes the result independent of the thread that runs it.
+    Xoshiro256 stream(uint64_t seed, uint64_t stream) {
+        uint64_t x = seed;
+        uint64_t key = Xoshiro256::splitmix64(x);
+        key += stream;
+        return Xoshiro256(Xoshiro256::splitmix64(key));
+    }
+
+    // Threads that are never seeded take their seed from the system.
     void init() {
         std::random_device rd;
-        mt = std::mt19937(rd());
+        engine_ = stream((uint64_t(rd()) << 32) | rd(), 0);
         initialized = true;
     }
 
-    void seed(int s) {
-        mt.seed(s);
+    void seed(uint64_t s, uint64_t stream_ = 0) {
+        engine_ = stream(s, stream_);
         initialized = true;
     }
 
+    Xoshiro256& engine() {
+        if (!initialized) init();
+        return engine_;
+    }
+
+    // Uniform in [a, b]. Lemire's multiply-shift, with the few biased values rejected.
     int get_rand_int(int a, int b) {
-        if (!initialized) {
-            init();
+        const uint64_t range = uint64_t(int64_t(b) - int64_t(a)) + 1;
+        uint64_t m = (engine()() >> 32) * range;
+        if (uint32_t(m) < range) {
+            const uint32_t threshold = uint32_t(((uint64_t(1) << 32) - range) % range);
+            while (uint32_t(m) < threshold) m = (engine_() >> 32) * range;
         }
-        std::uniform_int_distribution<int> distr(a,b);
-        return distr(mt);
+        return int(int64_t(a) + int64_t(m >> 32));
     }
 
+    // Uniform in [a, b), from the top 24 bits of one number. a + (b - a) * u can still round up to
+    // b, which is returned as the float just below b.
     float get_rand_float(float a, float b) {
-        if (!initialized) {
-            init();
-        }
-        std::uniform_real_distribution<> distr(a,b);
-        return distr(mt);
+        const float u = (engine()() >> 40) * (1.0f / 16777216.0f);
+        const float x = a + (b - a) * u;
+        return x < b ? x : std::nextafter(b, a);
     }
 
-    std::mt19937 getMT() {
-        if (!initialized) init();
-        return mt;
-    }
+    // Makes the calling thread draw from rng until the end of the scope. Parallel work items that
+    // carry their own generator this way give the same numbers whichever thread runs them.
+    class StreamScope {
+    public:
+        explicit StreamScope(Xoshiro256& _rng) : rng(_rng), was_initialized(initialized) {
+            std::swap(engine_, rng);
+            initialized = true;
+        }
+        ~StreamScope() {
+            std::swap(engine_, rng);
+            initialized = was_initialized;
+        }
+
+    private:
+        Xoshiro256& rng;
+        bool was_initialized;
+    };
 }
 
 #endif
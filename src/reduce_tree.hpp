@@ -2,123 +2,118 @@
 #define REDUCE_TREE_HPP
 
 //#include "treesearch.hpp"
-#include "starttree.hpp"
-
-void calculateAveragePairwiseDistance(std::vector<std::vector<double> >& D, Tree refTree, std::string pathToEvaluationTrees) {
-	std::vector<Tree> evalTrees;
+#include <queue>
+#include <tuple>
 
-	size_t N = refTree.node_count();
-	std::vector<std::vector<size_t> > occurInEval(N);
-	D.resize(N);
-	for (size_t i = 0; i < N; ++i) {
-		for (size_t j = 0; j < N; ++j) {
-			occurInEval[i].push_back(0);
-			D[i].push_back(0);
+#include "starttree.hpp"
+#include "symmetric_matrix.hpp"
+
+// Average distance in edges between every pair of taxa over the evaluation trees that contain both,
+// indexed by taxon id. Infinite for pairs that never occur together.
+template<typename T>
+void calculateAveragePairwiseDistance(SymmetricMatrix<T>& D, const EvalTrees& evalTrees) {
+	const size_t n = evalTrees.taxa().size();
+	SymmetricMatrix<uint32_t> occurInEval(n, 0);
+	SymmetricMatrix<uint64_t> distanceSum(n, 0);
+
+	// count how often pairs appear together and sum up their distances. Gene trees are processed in
+	// parallel; distances are whole numbers of edges, so the shared sums are exact integer atomics.
+	bool tooSmall = false;
+	#pragma omp parallel reduction(||:tooSmall)
+	{
+		std::vector<uint32_t> leaf_taxa;
+		std::vector<uint32_t> dist;
+		#pragma omp for schedule(dynamic, 4)
+		for (size_t t = 0; t < evalTrees.size(); ++t) {
+			evalTrees.leaf_distances(t, leaf_taxa, dist);
+			const size_t k = leaf_taxa.size();
+			for (size_t i = 0; i < k; ++i) {
+				for (size_t j = i; j < k; ++j) {
+					const uint32_t d = dist[i*k+j];
+					if (d < 2 and i != j) tooSmall = true;
+					uint32_t& occur = occurInEval(leaf_taxa[i], leaf_taxa[j]);
+					uint64_t& sum = distanceSum(leaf_taxa[i], leaf_taxa[j]);
+					#pragma omp atomic
+					occur++;
+					#pragma omp atomic
+					sum += d;
+				}
+			}
 		}
 	}
-
-	utils::InputStream instream(utils::make_unique<utils::FileInputSource>(pathToEvaluationTrees));
-	auto itTree = NewickInputIterator(instream, DefaultTreeNewickReader());
-	while (itTree) {
-		evalTrees.push_back(*itTree);
-		++itTree;
-	}
-
-	// Mapping node index <-> leaf name
-	std::map<std::string, size_t> mapLeaves;
-	std::map<size_t, std::string> revMapLeaves;
-	for (size_t i = 0; i < refTree.node_count(); ++i) {
-		if (refTree.node_at(i).is_leaf()){
-			mapLeaves[refTree.node_at(i).data<DefaultNodeData>().name] = i;
-			revMapLeaves[i] = refTree.node_at(i).data<DefaultNodeData>().name;
+	if (tooSmall) throw std::runtime_error("Distance too small.");
+
+	D = SymmetricMatrix<T>(n);
+	for (size_t i = 0; i < n; ++i) {
+		T* row = D.upper_row(i);
+		const uint32_t* occur = occurInEval.upper_row(i);
+		const uint64_t* sum = distanceSum.upper_row(i);
+		for (size_t j = 0; j < n - i; ++j) {
+			if (occur[j] > 0) row[j] = (T)sum[j] / occur[j];
+			else row[j] = std::numeric_limits<T>::infinity();
+			if (row[j] < 2 and j > 0) throw std::runtime_error("Avg. Distance too small.");
 		}
 	}
+}
 
-	// count how often pairs appear together
-	for (Tree tree : evalTrees) {
-		for (size_t i = 0; i < tree.node_count(); ++i) {
-			if (! tree.node_at(i).is_leaf()) continue;
-			for (size_t j = 0; j < tree.node_count(); ++j) {
-				if (! tree.node_at(j).is_leaf()) continue;
-				size_t u = mapLeaves[tree.node_at(i).data<DefaultNodeData>().name];
-				size_t v = mapLeaves[tree.node_at(j).data<DefaultNodeData>().name];
-				occurInEval[u][v]++;
-				occurInEval[v][u]++;
-			}
+// Average linkage clustering of items (indices into D). Repeatedly merges the two closest
+// clusters, as long as their distance is below maxDistance. Returns the clusters indexed by their
+// smallest item; a cluster lists that item first, then the items in the order they were merged in.
+// D is overwritten with the cluster distances. Candidate pairs are kept in a heap, stale entries are
+// skipped when popped, so this is O(n^2 log n).
+template<typename T>
+std::vector<std::vector<size_t> > average_linkage_clusters(SymmetricMatrix<T>& D, const std::vector<size_t>& items, double maxDistance) {
+	struct Pair {
+		double d;
+		size_t i, j;
+		size_t version_i, version_j;
+		bool operator>(const Pair& other) const { return std::tie(d, i, j) > std::tie(other.d, other.i, other.j); }
+	};
+	std::priority_queue<Pair, std::vector<Pair>, std::greater<Pair> > queue;
+
+	std::vector<std::vector<size_t> > sets(D.size());
+	std::vector<size_t> version(D.size(), 0);
+	for (size_t i : items) sets[i].push_back(i);
+	for (size_t a = 0; a < items.size(); ++a) {
+		for (size_t b = a+1; b < items.size(); ++b) {
+			size_t i = std::min(items[a], items[b]), j = std::max(items[a], items[b]);
+			if (D(i, j) < maxDistance) queue.push({D(i, j), i, j, 0, 0});
 		}
 	}
 
-	for (Tree tree : evalTrees) {
-		// TreeInformation (for LCA)
-		TreeInformation tinf;
-		tinf.init(tree);
-
-		// add pairwise distances to D
-		for (size_t i = 0; i < tree.node_count(); ++i) {
-			if (! tree.node_at(i).is_leaf()) continue;
-			for (size_t j = 0; j < tree.node_count(); ++j) {
-				if (! tree.node_at(j).is_leaf()) continue;
-				size_t u = mapLeaves[tree.node_at(i).data<DefaultNodeData>().name];
-				size_t v = mapLeaves[tree.node_at(j).data<DefaultNodeData>().name];
-				double d = tinf.distanceInEdges(i, j);
-        if (d < 2 and i != j) throw std::runtime_error("Distance too small.");
-				D[u][v] += d;
-				D[v][u] += d;
-			}
+	while (!queue.empty()) {
+		Pair p = queue.top();
+		queue.pop();
+		if (sets[p.i].empty() or sets[p.j].empty()) continue;
+		if (version[p.i] != p.version_i or version[p.j] != p.version_j) continue;
+
+		// merge j into i
+		const double ni = sets[p.i].size(), nj = sets[p.j].size();
+		for (size_t k : items) {
+			if (sets[k].empty() or k == p.i or k == p.j) continue;
+			D(p.i, k) = (ni * D(p.i, k) + nj * D(p.j, k)) / (ni + nj);
 		}
-	}
-	for (size_t i = 0; i < D.size(); ++i) {
-		for (size_t j = 0; j < D.size(); ++j) {
-        if (occurInEval[i][j] > 0) 
-            D[i][j] /= occurInEval[i][j];
-
-        else D[i][j] = std::numeric_limits<double>::infinity();
-        if (D[i][j] < 2 and i != j) throw std::runtime_error("Avg. Distance too small.");
+		for (auto x : sets[p.j]) sets[p.i].push_back(x);
+		sets[p.j].clear();
+		version[p.i]++;
+
+		for (size_t k : items) {
+			if (sets[k].empty() or k == p.i or D(p.i, k) >= maxDistance) continue;
+			size_t i = std::min(p.i, k), j = std::max(p.i, k);
+			queue.push({D(p.i, k), i, j, version[i], version[j]});
 		}
 	}
+	return sets;
 }
 
-std::vector<std::vector<std::string> > leaf_sets(std::string pathToEvaluationTrees) {
-	Tree r_tree = random_tree(pathToEvaluationTrees);
-    std::vector<std::vector<double> > D;
-    calculateAveragePairwiseDistance(D, r_tree, pathToEvaluationTrees);
+std::vector<std::vector<std::string> > leaf_sets(const EvalTrees& evalTrees) {
+    SymmetricMatrix<double> D;
+    calculateAveragePairwiseDistance(D, evalTrees);
 
-	std::vector<std::vector<size_t> > sets(r_tree.node_count());
-	for (size_t i = 0; i < r_tree.node_count(); ++i) {
-		if (r_tree.node_at(i).is_leaf()) sets[i].push_back(i);
-	}
+	std::vector<size_t> taxa(D.size());
+	for (size_t i = 0; i < taxa.size(); ++i) taxa[i] = i;
     const double D_MAX = 4;
-    bool continueMergingLeaves = true;
-    while (continueMergingLeaves) {
-    	size_t best_i, best_j;
-    	double max = D_MAX;
-
-	    for (size_t i = 0; i < r_tree.node_count(); ++i) {
-	        if (! r_tree.node_at(i).is_leaf()) continue;
-	        if (sets[i].empty()) continue;
-        	for (size_t j = i+1; j < r_tree.node_count(); ++j) {
-	            if (! r_tree.node_at(j).is_leaf()) continue;
-	            if (sets[j].empty()) continue;
-	            if (D[i][j] < max) {
-	            	max = D[i][j];
-	            	best_i = i;
-	            	best_j = j;
-	            }
-	        }
-	    }
-
-	    if (max < D_MAX) {
-	    	for (size_t k = 0; k < r_tree.node_count(); ++k) {
-	    		if (! r_tree.node_at(k).is_leaf()) continue;
-	    		double sum = D[best_i][k];
-	    		for (auto x : sets[best_j]) sum += D[x][k];
-    			D[best_i][k] = sum / (sets[best_j].size() + 1);
-	    	}
-	    	for (auto x : sets[best_j]) sets[best_i].push_back(x);
-    		sets[best_j].clear();
-	    }
-	    else continueMergingLeaves = false;
-	}
+	std::vector<std::vector<size_t> > sets = average_linkage_clusters(D, taxa, D_MAX);
 
 	std::vector<std::vector<std::string> > leafSets;
 	for (size_t i = 0; i < sets.size(); ++i) {
@@ -126,7 +121,7 @@ std::vector<std::vector<std::string> > leaf_sets(std::string pathToEvaluationTre
 		leafSets.push_back(std::vector<std::string>());
 
 		for (size_t j = 0; j < sets[i].size(); ++j) 
-			leafSets[leafSets.size()-1].push_back(r_tree.node_at(sets[i][j]).data<DefaultNodeData>().name);
+			leafSets[leafSets.size()-1].push_back(evalTrees.taxa()[sets[i][j]]);
 	}
   if (Logging::max_level() >= utils::Logging::kInfo) {
       std::cout << "Clustered Taxa:" << std::endl;
@@ -140,11 +135,20 @@ std::vector<std::vector<std::string> > leaf_sets(std::string pathToEvaluationTre
 }
 
 Tree expanded_cluster_tree(Tree& clusterTree, std::vector<std::vector<std::string> >& leafSets) {
-    for (size_t i = 0; i < clusterTree.node_count(); ++i) {
+    // Leaf set of every cluster representative, looked up once per leaf.
+    std::vector<std::string> representatives;
+    for (auto& leafSet : leafSets) representatives.push_back(leafSet[0]);
+    std::sort(representatives.begin(), representatives.end());
+    TaxonDictionary dictionary(representatives);
+    std::vector<size_t> setOf(leafSets.size());
+    for (size_t l_i = 0; l_i < leafSets.size(); ++l_i) setOf[dictionary.id(leafSets[l_i][0])] = l_i;
+
+    const size_t nodeCount = clusterTree.node_count();
+    for (size_t i = 0; i < nodeCount; ++i) {
         if (clusterTree.node_at(i).is_leaf()) {
-            size_t l_i = 0;
-            while (l_i < leafSets.size() and leafSets[l_i][0] != clusterTree.node_at(i).data<DefaultNodeData>().name) ++l_i;
-            if (l_i == leafSets.size()) continue; 
+            const std::string& name = clusterTree.node_at(i).data<DefaultNodeData>().name;
+            if (!dictionary.contains(name)) continue;
+            const size_t l_i = setOf[dictionary.id(name)];
             //for (size_t j = 1; j < leafSets[l_i].size(); ++j) {
         	for (int j = leafSets[l_i].size()-1; j >= 1; --j) {
                 add_new_node(clusterTree, clusterTree.node_at(i).link().edge()).secondary_link().node().data_cast<DefaultNodeData>()->name = leafSets[l_i][j];
@@ -0,0 +1,36 @@
+#ifndef REPLICATES_HPP
+#define REPLICATES_HPP
+
+#include "objective_function.hpp"
+#include "random.hpp"
+
+// Independent replicates of a tree search, run in parallel. search(qsc, r) runs replicate r and
+// returns its tree with qsc holding the scores of that tree. Replicate r draws from random stream
+// r of seed, so trees and scores do not depend on the thread count. Each thread keeps one set of
+// edge scores over the shared count table.
+//
+// Returns the replicate with the highest objective; on equal scores the lowest index wins.
+template<typename CINT, typename Objective, typename Search>
+size_t run_replicates(const QuartetCounts<CINT>& counts, size_t restarts, uint64_t seed, Search search,
+                      std::vector<Tree>& trees, std::vector<double>& scores) {
+    trees.assign(restarts, Tree());
+    scores.assign(restarts, 0);
+    #pragma omp parallel
+    {
+        TreeScores<CINT> qsc(counts);
+        #pragma omp for schedule(dynamic)
+        for (size_t r = 0; r < restarts; ++r) {
+            Random::seed(seed, r);
+            trees[r] = search(qsc, r);
+            scores[r] = Objective::obj_fun(qsc);
+        }
+    }
+
+    size_t best = 0;
+    for (size_t r = 1; r < restarts; ++r) {
+        if (scores[r] > scores[best]) best = r;
+    }
+    return best;
+}
+
+#endif
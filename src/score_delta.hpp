@@ -0,0 +1,280 @@
+#ifndef SCORE_DELTA_HPP
+#define SCORE_DELTA_HPP
+
+#include <cmath>
+
+#include "compact_tree.hpp"
+#include "tree_scores.hpp"
+
+enum NniVariant { NNI_A, NNI_B };
+
+// Read-only scoring of moves straight from the quartet counts. Nothing here touches the tree or a
+// TreeScores, so any number of threads can score moves on the same tree concurrently.
+template<typename CINT>
+struct DeltaScorer {
+    const QuartetCounts<CINT>& counts;
+    ObjectiveFunction objective;
+    std::vector<size_t> node_taxa;
+
+    DeltaScorer(const Tree& tree, const QuartetCounts<CINT>& _counts, ObjectiveFunction _objective)
+        : counts(_counts), objective(_objective), node_taxa(_counts.node_taxa(tree)) { }
+};
+
+// Appends the taxa of the subtree that `link` leads into.
+inline void subtree_taxa(const CompactTree& tree, size_t link, const std::vector<size_t>& node_taxa, std::vector<size_t>& out) {
+    std::vector<size_t> stack(1, tree.outer(link));
+    while (!stack.empty()) {
+        const size_t l = stack.back();
+        stack.pop_back();
+        if (tree.is_leaf(tree.link_node(l))) {
+            out.push_back(node_taxa[tree.link_node(l)]);
+            continue;
+        }
+        for (size_t n = tree.next(l); n != l; n = tree.next(n)) stack.push_back(tree.outer(n));
+    }
+}
+
+// Score of an edge whose sides are a,b | c,d.
+template<typename CINT>
+double quadripartition_score(const DeltaScorer<CINT>& scorer,
+                             const std::vector<size_t>& a, const std::vector<size_t>& b,
+                             const std::vector<size_t>& c, const std::vector<size_t>& d) {
+    QuartetSupport support;
+    add_quadripartition(scorer.counts, scorer.objective, a, b, c, d, support);
+    return support.score(scorer.objective);
+}
+
+// Change of the objective caused by nni_a/nni_b on inner edge e, without applying the move.
+//
+// Around e the four subtrees are reached through p.next(), p.next().next(), s.next() and
+// s.next().next() (p, s: primary and secondary link of e). Both moves keep the subtree behind
+// p.next() on its side: nni_a pairs it with the one behind s.next(), nni_b with s.next().next().
+// The delta mirrors the incremental updates in nni.hpp. For LQIC only e counts:
+// nni_*_with_lqic_update rescores e and swaps the values of the two reattached neighbours, although
+// their quadripartitions change as well. For EQPIC only e counts too, as the two reattached
+// neighbours trade bipartitions and so keep their sum. QPIC also counts the four neighbouring
+// edges, which are rescored because their quadripartitions include the sides of e.
+template<typename CINT>
+double score_delta_nni(const CompactTree& tree, size_t e, NniVariant variant, const DeltaScorer<CINT>& scorer) {
+    const size_t p = tree.primary_link(e);
+    const size_t s = tree.secondary_link(e);
+    const size_t around[4] = { tree.next(p), tree.next(tree.next(p)), tree.next(s), tree.next(tree.next(s)) };
+
+    std::vector<size_t> sub[4];
+    for (size_t i = 0; i < 4; ++i) subtree_taxa(tree, around[i], scorer.node_taxa, sub[i]);
+
+    // partner[i]: subtree on the same side of e as subtree i.
+    const size_t before[4] = { 1, 0, 3, 2 };
+    const size_t after_a[4] = { 2, 3, 0, 1 };
+    const size_t after_b[4] = { 3, 2, 1, 0 };
+    const size_t* after = (variant == NNI_A) ? after_a : after_b;
+
+    auto score_e = [&](const size_t* partner) {
+        size_t o = (partner[0] == 1) ? 2 : 1;
+        return quadripartition_score(scorer, sub[0], sub[partner[0]], sub[o], sub[partner[o]]);
+    };
+    double delta = score_e(after) - score_e(before);
+    if (scorer.objective != QPIC) return delta;
+
+    std::vector<size_t> z1, z2, rest;
+    for (size_t i = 0; i < 4; ++i) {
+        const size_t far = tree.outer(around[i]);
+        if (tree.is_leaf(tree.link_node(far))) continue;
+        z1.clear(); z2.clear();
+        subtree_taxa(tree, tree.next(far), scorer.node_taxa, z1);
+        subtree_taxa(tree, tree.next(tree.next(far)), scorer.node_taxa, z2);
+
+        for (const size_t* partner : { before, after }) {
+            rest.clear();
+            for (size_t j = 0; j < 4; ++j) {
+                if (j != i and j != partner[i]) rest.insert(rest.end(), sub[j].begin(), sub[j].end());
+            }
+            double score = quadripartition_score(scorer, z1, z2, sub[partner[i]], rest);
+            delta += (partner == after) ? score : -score;
+        }
+    }
+    return delta;
+}
+
+// Appends the edges of the subtree that `link` leads into, including the edge of link itself.
+inline void subtree_edges(const CompactTree& tree, size_t link, std::vector<size_t>& out) {
+    out.push_back(tree.link_edge(link));
+    std::vector<size_t> stack(1, tree.outer(link));
+    while (!stack.empty()) {
+        const size_t l = stack.back();
+        stack.pop_back();
+        for (size_t n = tree.next(l); n != l; n = tree.next(n)) {
+            out.push_back(tree.link_edge(n));
+            stack.push_back(tree.outer(n));
+        }
+    }
+}
+
+// Quartet supports that score_insertions keeps between insertions into the same growing tree.
+// edge holds the support of every inner edge of the current tree; it is empty for a new tree,
+// and score_insertions then counts every edge's quartets once. joined and half are filled by
+// score_insertions: joined[g][i] is the support of inner edge g when x joins its subtree i,
+// half[f][k] the one of the new inner edge at end k of f (0 for the primary link) when x is
+// inserted on f. After inserting x on f, insert(tree, f) makes edge hold the supports of the grown
+// tree, so the next step only counts the quartets that contain the next taxon.
+struct InsertionSupports {
+    std::vector<QuartetSupport> edge;
+    std::vector<std::array<QuartetSupport, 4> > joined;
+    std::vector<std::array<QuartetSupport, 2> > half;
+
+    // tree is the tree before the insertion, whose edges are renumbered like CompactTree::insert_leaf
+    // and add_new_node do: f keeps the half at its primary link, the other half and the new leaf
+    // edge are appended.
+    void insert(const CompactTree& tree, size_t f) {
+        const size_t E = tree.edge_count();
+        std::vector<QuartetSupport> grown(E + 2);
+        grown[f] = half[f][0];
+        grown[E] = half[f][1];
+        // Walk away from f. An edge reached through link m, with f behind link toward at the same
+        // node, has x in the subtree around toward.
+        std::vector<std::pair<size_t, size_t> > stack;
+        for (size_t end : { tree.primary_link(f), tree.secondary_link(f) }) {
+            for (size_t m = tree.next(end); m != end; m = tree.next(m)) stack.push_back({ m, end });
+        }
+        while (!stack.empty()) {
+            const size_t m = stack.back().first, toward = stack.back().second;
+            stack.pop_back();
+            const size_t g = tree.link_edge(m);
+            if (!tree.is_inner_edge(g)) continue;
+            const size_t p = tree.primary_link(g);
+            const size_t s = tree.secondary_link(g);
+            const size_t around[4] = { tree.next(p), tree.next(tree.next(p)), tree.next(s), tree.next(tree.next(s)) };
+            for (size_t i = 0; i < 4; ++i) {
+                if (around[i] == toward) grown[g] = joined[g][i];
+            }
+            const size_t o = tree.outer(m);
+            for (size_t n = tree.next(o); n != o; n = tree.next(n)) stack.push_back({ n, o });
+        }
+        edge.swap(grown);
+    }
+};
+
+// Change of the objective for inserting the leaf of taxon x on each edge of tree (as add_new_node
+// does), without inserting it. gain[f] is the change for edge f.
+//
+// Every inner edge g other than f keeps its four subtrees, and x joins the one that contains f.
+// So g contributes one of four values, each needing only the quartets that contain x, and
+// these are added to all edges of the respective subtree. With supports carried over from the
+// previous insertion, g's current support is not counted again either. Only the two halves of f itself are
+// scored from scratch, and for EQPIC even they follow from f's support, as their bipartitions are
+// f's with x added to one side.
+//
+// The edges are scored in parallel. The contributions are added up in edge order afterwards, so
+// the gains do not depend on the number of threads. If scores is given, it receives the current
+// score of every inner edge (0 for leaf edges), which come for free. If child_scores is given,
+// child_scores[f] receives the scores of all inner edges of the tree with x inserted on f.
+template<typename CINT>
+void score_insertions(const CompactTree& tree, size_t x, const DeltaScorer<CINT>& scorer, std::vector<double>& gain,
+                      std::vector<double>* scores = nullptr, std::vector<std::vector<double> >* child_scores = nullptr,
+                      InsertionSupports* supports = nullptr) {
+    const ObjectiveFunction objective = scorer.objective;
+    const QuartetCounts<CINT>& counts = scorer.counts;
+    const size_t E = tree.edge_count();
+    gain.assign(E, 0);
+    InsertionSupports local;
+    InsertionSupports& support = supports ? *supports : local;
+    const bool carried = support.edge.size() == E;
+    if (!carried) support.edge.assign(E, QuartetSupport());
+    support.joined.assign(E, std::array<QuartetSupport, 4>());
+    support.half.assign(E, std::array<QuartetSupport, 2>());
+    // Of inner edge g: its score and the change when x joins each of its four subtrees.
+    std::vector<double> before(E, 0);
+    std::vector<std::array<double, 4> > delta(E);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t g = 0; g < E; ++g) {
+        if (!tree.is_inner_edge(g)) continue;
+        const size_t p = tree.primary_link(g);
+        const size_t s = tree.secondary_link(g);
+        const size_t around[4] = { tree.next(p), tree.next(tree.next(p)), tree.next(s), tree.next(tree.next(s)) };
+        std::vector<size_t> sub[4];
+        for (size_t i = 0; i < 4; ++i) subtree_taxa(tree, around[i], scorer.node_taxa, sub[i]);
+
+        if (!carried) add_quadripartition(counts, objective, sub[0], sub[1], sub[2], sub[3], support.edge[g]);
+        before[g] = support.edge[g].score(objective);
+
+        for (size_t i = 0; i < 4; ++i) {
+            // x joins sub[i], which is paired with sub[i^1].
+            QuartetSupport& with = support.joined[g][i];
+            if (objective == EQPIC and i % 2 == 1) {
+                // Same bipartition as x joining sub[i-1].
+                with = support.joined[g][i-1];
+                delta[g][i] = delta[g][i-1];
+                continue;
+            }
+            with = support.edge[g];
+            if (objective != EQPIC) {
+                // Taxa in subtree order, so the alternative topologies add up with the right ones.
+                std::array<size_t, 4> q;
+                q[i] = x;
+                const size_t j = (i + 1) % 4, k = (i + 2) % 4, l = (i + 3) % 4;
+                for (size_t y : sub[j]) for (size_t u : sub[k]) for (size_t v : sub[l]) {
+                    q[j] = y; q[k] = u; q[l] = v;
+                    with.add(objective, counts.get(q[0], q[1], q[2], q[3]));
+                }
+            } else {
+                const std::vector<size_t>& c = sub[i < 2 ? 2 : 0];
+                const std::vector<size_t>& d = sub[i < 2 ? 3 : 1];
+                std::vector<size_t> right(c);
+                right.insert(right.end(), d.begin(), d.end());
+                for (size_t side = i; side < i + 2; ++side) for (size_t y : sub[side])
+                for (size_t k = 0; k < right.size(); ++k) for (size_t l = k+1; l < right.size(); ++l)
+                    add_split_quartet(counts, x, y, right[k], right[l], with);
+            }
+            delta[g][i] = with.score(objective) - before[g];
+        }
+    }
+
+    if (scores) *scores = before;
+    if (child_scores) child_scores->assign(E, std::vector<double>());
+    std::vector<size_t> edges;
+    for (size_t g = 0; g < E; ++g) {
+        if (!tree.is_inner_edge(g)) continue;
+        gain[g] -= before[g];
+        const size_t p = tree.primary_link(g);
+        const size_t s = tree.secondary_link(g);
+        const size_t around[4] = { tree.next(p), tree.next(tree.next(p)), tree.next(s), tree.next(tree.next(s)) };
+        for (size_t i = 0; i < 4; ++i) {
+            edges.clear();
+            subtree_edges(tree, around[i], edges);
+            for (size_t f : edges) gain[f] += delta[g][i];
+            if (child_scores) {
+                for (size_t f : edges) (*child_scores)[f].push_back(before[g] + delta[g][i]);
+            }
+        }
+    }
+
+    // The new inner edges: from each inner end of f to the new node, which has x and the other end.
+    // For EQPIC on an inner f, their bipartitions are f's with x on the other side. Otherwise the
+    // subtrees are taken in the order the grown tree has them around the new edge.
+    const std::vector<size_t> leaf_x(1, x);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t f = 0; f < E; ++f) {
+        const size_t ends[2] = { tree.primary_link(f), tree.secondary_link(f) };
+        std::vector<size_t> a, b, other;
+        for (size_t k = 0; k < 2; ++k) {
+            const size_t l = ends[k];
+            if (tree.is_leaf(tree.link_node(l))) continue;
+            QuartetSupport& half = support.half[f][k];
+            if (objective == EQPIC and tree.is_inner_edge(f)) {
+                half = support.joined[f][k == 0 ? 2 : 0];
+            } else {
+                a.clear(); b.clear(); other.clear();
+                subtree_taxa(tree, tree.next(l), scorer.node_taxa, a);
+                subtree_taxa(tree, tree.next(tree.next(l)), scorer.node_taxa, b);
+                subtree_taxa(tree, l, scorer.node_taxa, other);
+                if (k == 0) add_quadripartition(counts, objective, a, b, other, leaf_x, half);
+                else add_quadripartition(counts, objective, leaf_x, other, a, b, half);
+            }
+            gain[f] += half.score(objective);
+            if (child_scores) (*child_scores)[f].push_back(half.score(objective));
+        }
+    }
+}
+
+#endif
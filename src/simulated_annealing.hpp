@@ -4,114 +4,237 @@
 #include "objective_function.hpp"
 #include "nni.hpp"
 #include "spr.hpp"
+#include "move_journal.hpp"
+#include "move_proposer.hpp"
 
 
-template<typename CINT>
-void simulated_annealing_helper(Tree& tree, QuartetScoreComputer<CINT>& qsc, ObjectiveFunction objective) {
-    Functions<CINT> functions = Functions<CINT>(objective);
-
-    const float m = Random::get_rand_float(0,1);
-    const int ab = Random::get_rand_int(0, 1);
-    size_t e, p, r;
-    if (m < 0.8) { //NNI
-        e = Random::get_rand_int(0, tree.edge_count()-1);
-        while (tree.edge_at(e).secondary_link().node().is_leaf())
-            e = Random::get_rand_int(0, tree.edge_count()-1);
-        if (ab == 0)
-            functions.nni_a(tree, e, qsc);
-        else
-            functions.nni_b(tree, e, qsc);
-    }
-    else { //SPR
-        p = Random::get_rand_int(0, tree.edge_count()-1);
-        r = Random::get_rand_int(0, tree.edge_count()-1);
-        while (!validSprMove(tree, p, r)) {
-            p = Random::get_rand_int(0, tree.edge_count()-1);
-            r = Random::get_rand_int(0, tree.edge_count()-1);
-        }
-        spr(tree, p, r);
-        functions.spr_score_update(tree, p, r, qsc);
-    }
-}
-
-template<typename CINT>
-Tree simulated_annealing(Tree& tree, QuartetScoreComputer<CINT>& qsc, bool lowtemp, ObjectiveFunction objective, float factor = 0.005) {
-    Functions<CINT> functions = Functions<CINT>(objective);
+// Temperature at which the average downhill step of a random walk from tree is accepted with
+// probability P0. The walk draws its moves like the annealers do. qsc must hold the scores of tree
+// and does so again afterwards.
+template<typename CINT, typename Objective>
+double annealing_start_temperature(const Tree& tree, TreeScores<CINT>& qsc, const Objective& functions, double P0) {
     Tree current(tree);
-    const size_t M = tree.edge_count();
     const size_t Ntrial = 100;
-    const size_t MAX_EPOCH_LENGTH = std::max((int)(factor*tree.edge_count()*tree.edge_count()), 10);
+    ObjectiveSum<CINT, Objective> objective_sum(qsc, functions);
+    MoveProposer<CINT, Objective> proposer(tree, qsc, functions);
 
     double trial_sum_downhill = 0;
     size_t trial_count_downhill = 0;
     for (size_t i = 0; i < Ntrial or trial_count_downhill < 2; ++i) {
-        double score_curr = functions.obj_fun(qsc);
-        Tree candidate(current);
-        simulated_annealing_helper(candidate, qsc, objective);
-        double score = functions.obj_fun(qsc);
-        //LOG_INFO << score << " " << score_curr << std::endl;
+        double score_curr = objective_sum.value();
+        proposer.propose(current, objective_sum);
+        proposer.update_weights(objective_sum);
+        double score = objective_sum.value();
         if (score < score_curr) {
             trial_sum_downhill += (score - score_curr);
             trial_count_downhill++;
         }
-        current = candidate;
     }
-    current = Tree(tree);
-    qsc.recomputeScores(current, false);
+    qsc.recomputeScores(tree);
+    return (trial_sum_downhill/trial_count_downhill)/log(P0);
+}
+
+template<typename CINT, typename Objective>
+Tree simulated_annealing(Tree& tree, TreeScores<CINT>& qsc, bool lowtemp, const Objective& functions, float factor = 0.005) {
+    Tree current(tree);
+    const size_t M = tree.edge_count();
+    const size_t MAX_EPOCH_LENGTH = std::max((int)(factor*tree.edge_count()*tree.edge_count()), 10);
 
     const double P0 = lowtemp ? 0.002 : 0.2;
-    const double T0 = (trial_sum_downhill/trial_count_downhill)/log(P0);
+    const double T0 = annealing_start_temperature(tree, qsc, functions, P0);
+    ObjectiveSum<CINT, Objective> objective_sum(qsc, functions);
+    MoveProposer<CINT, Objective> proposer(tree, qsc, functions);
     const double TM = 0.001;
     const double alpha = pow(TM/T0, 1.0/(M-1));
-    std::cout << T0 << " " << alpha << std::endl;
+    LOG_DBG << "T0: " << T0 << "  --  alpha: " << alpha << std::endl;
     double T = T0;
 
     size_t C = 0;
     const size_t MAX_NO_CHANGE = 2;
     const double P_ACCEPT = std::max(1.0/MAX_EPOCH_LENGTH, 0.02);
+    const double P_HIGH = 0.5;
 
-    Tree best = current;
-    double max = functions.obj_fun(qsc);
+    // Accepted moves since the best tree, so the best tree is rebuilt from current at the end
+    // instead of being copied on every improvement. Past one move per edge a single copy is
+    // cheaper to keep than the moves.
+    BestTreeJournal<Tree> since_best(M);
+    double max = objective_sum.value();
     while (C < MAX_NO_CHANGE) {
         size_t accepted = 0;
-        LOG_INFO << C << "/" << MAX_NO_CHANGE << " --  T:" << T << "  --  current: " <<  functions.obj_fun(qsc) << std::endl;
+        bool new_best = false;
+        LOG_INFO << C << "/" << MAX_NO_CHANGE << " --  T:" << T << "  --  current: " <<  objective_sum.value()
+                 << "  --  NNI: " << proposer.type_probability(PROPOSE_NNI) << std::endl;
         for (size_t i = 0; i < MAX_EPOCH_LENGTH; ++i) {
-            std::vector<double> scores = functions.getScores(qsc);
-            double score_curr = functions.obj_fun(qsc);
+            double score_curr = objective_sum.value();
 
-            Tree candidate(current);
-            simulated_annealing_helper(candidate, qsc, objective);
-            //qsc.recomputeScores(candidate, false);
-            double score = functions.obj_fun(qsc);
+            Move move = proposer.propose(current, objective_sum);
+            double score = objective_sum.value();
             double R = exp((score-score_curr)/T);
-            //std::cout << R << " (" << score << ") ";
 
             if (R > 1) {
-                current = candidate;
                 accepted++;
                 if (score > max) {
                     max = score;
-                    best = Tree(candidate);
+                    new_best = true;
+                    since_best.clear();
+                } else {
+                    since_best.record(current, move);
                 }
+                proposer.feedback(true, score > score_curr, objective_sum);
             } else {
                 if (Random::get_rand_float(0.0, 1.0) < R) {
-                    current = candidate;
+                    since_best.record(current, move);
                     accepted++;
+                    proposer.feedback(true, false, objective_sum);
                 }
                 else {
-                    for (size_t e = 0; e < current.edge_count(); ++e) {
-                        functions.setScore(qsc, e, scores[e]);
-                    }
+                    // NNI and SPR are their own inverse, and only the touched edges need their
+                    // old scores back.
+                    apply_move(current, move);
+                    objective_sum.revert();
+                    proposer.feedback(false, false, objective_sum);
                 }
             }
         }
-        if (accepted/(double)MAX_EPOCH_LENGTH < P_ACCEPT) C++;
+        const double acceptance = accepted/(double)MAX_EPOCH_LENGTH;
+        if (acceptance < P_ACCEPT) C++;
         else C = 0;
-        //std::cout << "  " << accepted << std::endl;
 
-        T = alpha * T;
+        // Cool twice as fast while almost every move is taken, and hold the temperature while
+        // it still finds better trees.
+        if (acceptance > P_HIGH) T = alpha * alpha * T;
+        else if (!new_best) T = alpha * T;
+    }
+    since_best.undo(current);
+    return current;
+}
+
+template<typename CINT>
+Tree simulated_annealing(Tree& tree, TreeScores<CINT>& qsc, bool lowtemp, ObjectiveFunction objective, float factor = 0.005) {
+    switch (objective) {
+    case LQIC: return simulated_annealing(tree, qsc, lowtemp, LqicObjective<CINT>(), factor);
+    case QPIC: return simulated_annealing(tree, qsc, lowtemp, QpicObjective<CINT>(), factor);
+    case EQPIC: return simulated_annealing(tree, qsc, lowtemp, EqpicObjective<CINT>(), factor);
+    }
+    return tree;
+}
+
+// One chain of parallel_tempering: a tree with its own edge scores, walked in place like the single
+// chain of simulated_annealing. The scores are a copy of the start tree's, which costs the score
+// vectors only; the quartet count table stays shared by all chains.
+template<typename CINT, typename Objective>
+struct TemperingChain {
+    Tree tree;
+    TreeScores<CINT> qsc;
+    ObjectiveSum<CINT, Objective> objective_sum;
+    MoveProposer<CINT, Objective> proposer;
+    // Accepted moves since the best tree of this chain.
+    BestTreeJournal<Tree> since_best;
+    double best;
+    // The chain's own random numbers, so the run does not depend on which thread steps the chain.
+    Xoshiro256 rng;
+
+    TemperingChain(const Tree& t, const TreeScores<CINT>& q, const Objective& functions, const Xoshiro256& _rng)
+        : tree(t), qsc(q), objective_sum(qsc, functions), proposer(tree, qsc, functions), since_best(t.edge_count()),
+          best(objective_sum.value()), rng(_rng) {}
+};
+
+// Replica exchange: K chains at fixed temperatures, geometric between the end temperature of
+// simulated_annealing and its start temperature, each run by its own thread on its own edge
+// scores. After every epoch, neighbouring temperatures swap their chains with the Metropolis
+// probability of the exchange, even and odd pairs in turn. Stops when no chain has found a better
+// tree for MAX_NO_CHANGE epochs. chains == 0 means one chain per thread, but at least two; a single
+// chain has nothing to exchange with and is rejected.
+template<typename CINT, typename Objective>
+Tree parallel_tempering(Tree& tree, TreeScores<CINT>& qsc, const Objective& functions, size_t chains = 0, float factor = 0.005) {
+    if (chains == 1) throw std::runtime_error("Parallel tempering needs at least two chains");
+    const size_t K = chains ? chains : std::max((size_t)omp_get_max_threads(), (size_t)2);
+    const size_t MAX_EPOCH_LENGTH = std::max((int)(factor*tree.edge_count()*tree.edge_count()), 10);
+    const size_t MAX_NO_CHANGE = 10;
+
+    qsc.recomputeScores(tree);
+    const double T0 = annealing_start_temperature(tree, qsc, functions, 0.2);
+    const double TM = 0.001;
+    std::vector<double> T(K);
+    for (size_t k = 0; k < K; ++k) T[k] = TM * pow(T0/TM, k/(double)(K-1));
+
+    // chain_at[k] runs at temperature T[k], the coldest first.
+    std::vector<std::unique_ptr<TemperingChain<CINT, Objective> > > chain(K);
+    std::vector<size_t> chain_at(K);
+    const uint64_t seed = Random::engine()();
+    for (size_t c = 0; c < K; ++c) {
+        chain[c] = std::unique_ptr<TemperingChain<CINT, Objective> >(new TemperingChain<CINT, Objective>(tree, qsc, functions, Random::stream(seed, c)));
+        chain_at[c] = c;
+    }
+
+    double max = chain[0]->best;
+    size_t C = 0;
+    for (size_t epoch = 0; C < MAX_NO_CHANGE; ++epoch) {
+        #pragma omp parallel for schedule(static, 1)
+        for (size_t k = 0; k < K; ++k) {
+            TemperingChain<CINT, Objective>& c = *chain[chain_at[k]];
+            Random::StreamScope scope(c.rng);
+            for (size_t i = 0; i < MAX_EPOCH_LENGTH; ++i) {
+                double score_curr = c.objective_sum.value();
+                Move move = c.proposer.propose(c.tree, c.objective_sum);
+                double score = c.objective_sum.value();
+                double R = exp((score-score_curr)/T[k]);
+
+                if (R > 1 or Random::get_rand_float(0.0, 1.0) < R) {
+                    if (score > c.best) {
+                        c.best = score;
+                        c.since_best.clear();
+                    } else {
+                        c.since_best.record(c.tree, move);
+                    }
+                    c.proposer.feedback(true, score > score_curr, c.objective_sum);
+                } else {
+                    apply_move(c.tree, move);
+                    c.objective_sum.revert();
+                    c.proposer.feedback(false, false, c.objective_sum);
+                }
+            }
+        }
+
+        size_t swaps = 0;
+        for (size_t k = epoch % 2; k + 1 < K; k += 2) {
+            const double cold = chain[chain_at[k]]->objective_sum.value();
+            const double hot = chain[chain_at[k+1]]->objective_sum.value();
+            const double R = exp((hot - cold) * (1/T[k] - 1/T[k+1]));
+            if (R > 1 or Random::get_rand_float(0.0, 1.0) < R) {
+                std::swap(chain_at[k], chain_at[k+1]);
+                swaps++;
+            }
+        }
+
+        double epoch_max = max;
+        for (size_t c = 0; c < K; ++c) epoch_max = std::max(epoch_max, chain[c]->best);
+        if (epoch_max > max) {
+            max = epoch_max;
+            C = 0;
+        } else C++;
+        LOG_INFO << C << "/" << MAX_NO_CHANGE << " --  coldest: " << chain[chain_at[0]]->objective_sum.value()
+                 << "  --  best: " << max << "  --  swaps: " << swaps << std::endl;
+    }
+
+    size_t best = 0;
+    for (size_t c = 1; c < K; ++c) {
+        if (chain[c]->best > chain[best]->best) best = c;
+    }
+    Tree result = chain[best]->tree;
+    chain[best]->since_best.undo(result);
+    qsc.recomputeScores(result);
+    return result;
+}
+
+template<typename CINT>
+Tree parallel_tempering(Tree& tree, TreeScores<CINT>& qsc, ObjectiveFunction objective, size_t chains = 0, float factor = 0.005) {
+    switch (objective) {
+    case LQIC: return parallel_tempering(tree, qsc, LqicObjective<CINT>(), chains, factor);
+    case QPIC: return parallel_tempering(tree, qsc, QpicObjective<CINT>(), chains, factor);
+    case EQPIC: return parallel_tempering(tree, qsc, EqpicObjective<CINT>(), chains, factor);
     }
-    return best;
+    return tree;
 }
 
 
@@ -7,11 +7,36 @@
 //-----------------------------------------------------
 void spr(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx);
 bool validSprMove(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx);
-template<typename CINT> void spr_lqic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, QuartetScoreComputer<CINT>& qsc);
+void spr_lqic_path(const Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, std::vector<size_t>& edges);
+void spr_qpic_edges(const Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, std::vector<size_t>& edges);
+template<typename CINT> void spr_lqic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, TreeScores<CINT>& qsc);
 bool has_negative_lqic_on_spr_path(const Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, const std::vector<double>& lqic);
+void spr_regraft_edges_within(const Tree& tree, size_t pruneEdgeIdx, size_t radius, std::vector<size_t>& edges);
 //------------------------------------------------------
 
 
+// The SPR moves of one tree state, with validSprMove answered in O(1). A single Euler tour from
+// the root numbers every edge when it is entered (through its primary link) and left (through its
+// secondary link), so the pruned subtree of an edge is the interval between its two numbers. The
+// tree may be changed in between as long as it is back in this state when the moves are queried.
+class SprNeighborhood {
+public:
+    SprNeighborhood() {}
+    explicit SprNeighborhood(const Tree& tree);
+
+    bool valid(size_t pruneEdgeIdx, size_t regraftEdgeIdx) const;
+    // The valid regraft edges of pruneEdgeIdx, in increasing order.
+    void regraft_edges(size_t pruneEdgeIdx, std::vector<size_t>& edges) const;
+
+private:
+    std::vector<size_t> enter;
+    std::vector<size_t> leave;
+    // The other two edges at the primary node of each edge.
+    std::vector<size_t> sibling_a;
+    std::vector<size_t> sibling_b;
+};
+
+
 template<typename CINT>
 GENERATOR(spr_generator_qsc) {
     size_t i;
@@ -19,14 +44,16 @@ GENERATOR(spr_generator_qsc) {
     std::vector<double> lqic;
     std::vector<size_t> invalidLQIC;
     Tree tree;
-    QuartetScoreComputer<CINT>* qsc;
+    TreeScores<CINT>* qsc;
     bool restrict_by_lqic;
-    spr_generator_qsc(Tree t, QuartetScoreComputer<CINT>* _qsc, bool _restrict_by_lqic) { tree = t; qsc = _qsc; restrict_by_lqic = _restrict_by_lqic; }
+    SprNeighborhood neighborhood;
+    spr_generator_qsc(Tree t, TreeScores<CINT>* _qsc, bool _restrict_by_lqic) { tree = t; qsc = _qsc; restrict_by_lqic = _restrict_by_lqic; }
 
     EMIT(Tree)
+        neighborhood = SprNeighborhood(tree);
         for (i = 0; i < tree.edge_count(); ++i) {
             for (j = 0; j < tree.edge_count(); ++j) {
-                if (!validSprMove(tree, i, j)) continue;
+                if (!neighborhood.valid(i, j)) continue;
                 if (restrict_by_lqic and !has_negative_lqic_on_spr_path(tree, i, j, qsc->getLQICScores())) continue;
 
                 spr(tree, i, j);
@@ -39,11 +66,18 @@ GENERATOR(spr_generator_qsc) {
     STOP;
 };
 
-template<typename CINT>
-void spr_lqic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, QuartetScoreComputer<CINT>& qsc) {
-    std::vector<size_t> i1;
-    std::vector<size_t> i2;
-    std::vector<size_t> invalidLQIC;
+// The path scratch is kept per thread, since this runs for every move the annealer proposes. It
+// and edges are sized for the longest possible path up front, so no call allocates once a tree of
+// this size has been seen.
+void spr_lqic_path(const Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, std::vector<size_t>& edges) {
+    static thread_local std::vector<size_t> i1;
+    static thread_local std::vector<size_t> i2;
+    i1.clear();
+    i2.clear();
+    edges.clear();
+    i1.reserve(tree.edge_count());
+    i2.reserve(tree.edge_count());
+    edges.reserve(tree.edge_count());
 
     size_t pruneLinkIdx = tree.edge_at(pruneEdgeIdx).primary_link().index();
     size_t link_prune_no = tree.link_at(pruneLinkIdx).next().outer().index();
@@ -82,35 +116,57 @@ void spr_lqic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, Qua
         i2.pop_back(); --i; --j;
     }
 
-    invalidLQIC.reserve(i1.size() + i2.size() + 1);
-    for (size_t i = 0; i < i1.size(); ++i) invalidLQIC.push_back(i1[i]);
-    for (size_t i = 0; i < i2.size(); ++i) invalidLQIC.push_back(i2[i]);
-
-    qsc.recomputeLqicForEdge(tree, invalidLQIC[0]);
-    for (auto it = invalidLQIC.begin()+1; it != invalidLQIC.end(); ++it) qsc.recomputeLqicForEdge(*it);
+    for (size_t i = 0; i < i1.size(); ++i) edges.push_back(i1[i]);
+    for (size_t i = 0; i < i2.size(); ++i) edges.push_back(i2[i]);
 }
 
 template<typename CINT>
-void spr_qpic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, QuartetScoreComputer<CINT>& qsc) {
-    (void)pruneEdgeIdx;
-    (void)regraftEdgeIdx;
-    qsc.recomputeQpicForEdge(tree, 0);
-    for (size_t e = 1; e < tree.edge_count(); ++e) {
-        qsc.recomputeQpicForEdge(e);
-    }
+void spr_lqic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, TreeScores<CINT>& qsc) {
+    static thread_local std::vector<size_t> invalidLQIC;
+    spr_lqic_path(tree, pruneEdgeIdx, regraftEdgeIdx, invalidLQIC);
 
-    TODO( Too many unnecessary edges get recomputed)
+    for (size_t e : invalidLQIC) qsc.recomputeLqicForEdge(tree, e);
+}
+
+// Edges whose QPIC an SPR move can change: the quadripartition of an edge changes if its own
+// bipartition changes (the LQIC path) or if one of the subtrees next to it does, i.e. if it is
+// adjacent to the path.
+void spr_qpic_edges(const Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, std::vector<size_t>& edges) {
+    spr_lqic_path(tree, pruneEdgeIdx, regraftEdgeIdx, edges);
+    // All false between calls, only the listed edges are set and cleared again.
+    static thread_local std::vector<bool> seen;
+    if (seen.size() < tree.edge_count()) seen.resize(tree.edge_count(), false);
+    for (size_t e : edges) seen[e] = true;
+
+    const size_t n = edges.size();
+    for (size_t i = 0; i < n; ++i) {
+        const TreeEdge& edge = tree.edge_at(edges[i]);
+        for (const TreeLink* end : { &edge.primary_link(), &edge.secondary_link() }) {
+            for (const TreeLink* l = &end->next(); l != end; l = &l->next()) {
+                if (seen[l->edge().index()]) continue;
+                seen[l->edge().index()] = true;
+                edges.push_back(l->edge().index());
+            }
         }
+    }
+    for (size_t e : edges) seen[e] = false;
+}
 
 template<typename CINT>
-void spr_eqpic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, QuartetScoreComputer<CINT>& qsc) {
-    (void)pruneEdgeIdx;
-    (void)regraftEdgeIdx;
-    TODO( Too many unnecessary edges get recomputed)
-    qsc.recomputeEqpicForEdge(tree, 0);
-    for (size_t e = 1; e < tree.edge_count(); ++e) {
-        qsc.recomputeEqpicForEdge(e);
-    }
+void spr_qpic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, TreeScores<CINT>& qsc) {
+    static thread_local std::vector<size_t> invalidQPIC;
+    spr_qpic_edges(tree, pruneEdgeIdx, regraftEdgeIdx, invalidQPIC);
+
+    for (size_t e : invalidQPIC) qsc.recomputeQpicForEdge(tree, e);
+}
+
+// EQPIC only depends on the bipartition of an edge, which changes exactly on the LQIC path.
+template<typename CINT>
+void spr_eqpic_update(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, TreeScores<CINT>& qsc) {
+    static thread_local std::vector<size_t> invalidEQPIC;
+    spr_lqic_path(tree, pruneEdgeIdx, regraftEdgeIdx, invalidEQPIC);
+
+    for (size_t e : invalidEQPIC) qsc.recomputeEqpicForEdge(tree, e);
 }
 
 bool validSprMove(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx) {
@@ -127,6 +183,55 @@ bool validSprMove(Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx) {
     return true;
 }
 
+SprNeighborhood::SprNeighborhood(const Tree& tree)
+    : enter(tree.edge_count()), leave(tree.edge_count()), sibling_a(tree.edge_count()), sibling_b(tree.edge_count()) {
+    size_t t = 0;
+    for (auto it : eulertour(tree)) {
+        const size_t e = it.edge().index();
+        if (it.link().index() == it.edge().primary_link().index()) enter[e] = t++;
+        else leave[e] = t++;
+    }
+    for (size_t e = 0; e < tree.edge_count(); ++e) {
+        sibling_a[e] = tree.edge_at(e).primary_link().next().edge().index();
+        sibling_b[e] = tree.edge_at(e).primary_link().next().next().edge().index();
+    }
+}
+
+bool SprNeighborhood::valid(size_t pruneEdgeIdx, size_t regraftEdgeIdx) const {
+    if (pruneEdgeIdx >= enter.size() or regraftEdgeIdx >= enter.size()) return false;
+    if (regraftEdgeIdx == sibling_a[pruneEdgeIdx] or regraftEdgeIdx == sibling_b[pruneEdgeIdx]) return false;
+    // Covers pruneEdgeIdx == regraftEdgeIdx.
+    return enter[regraftEdgeIdx] < enter[pruneEdgeIdx] or enter[regraftEdgeIdx] > leave[pruneEdgeIdx];
+}
+
+void SprNeighborhood::regraft_edges(size_t pruneEdgeIdx, std::vector<size_t>& edges) const {
+    edges.clear();
+    for (size_t r = 0; r < enter.size(); ++r) {
+        if (valid(pruneEdgeIdx, r)) edges.push_back(r);
+    }
+}
+
+// Regraft edges at most radius edges away from the prune point, nearest first. The walk starts at
+// the two edges next to the pruned subtree, which become one edge when it is pruned, so they are
+// not listed themselves; nor is anything inside the pruned subtree.
+void spr_regraft_edges_within(const Tree& tree, size_t pruneEdgeIdx, size_t radius, std::vector<size_t>& edges) {
+    edges.clear();
+    const TreeLink& p = tree.edge_at(pruneEdgeIdx).primary_link();
+    std::vector<const TreeLink*> level = { &p.next(), &p.next().next() };
+    std::vector<const TreeLink*> further;
+    for (size_t d = 0; d < radius and !level.empty(); ++d) {
+        further.clear();
+        for (const TreeLink* l : level) {
+            const TreeLink& o = l->outer();
+            for (const TreeLink* n = &o.next(); n != &o; n = &n->next()) {
+                edges.push_back(n->edge().index());
+                further.push_back(n);
+            }
+        }
+        std::swap(level, further);
+    }
+}
+
 bool has_negative_lqic_on_spr_path(const Tree& tree, size_t pruneEdgeIdx, size_t regraftEdgeIdx, const std::vector<double>& lqic) {
     std::vector<size_t> i1;
     std::vector<size_t> i2;
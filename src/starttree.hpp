@@ -1,7 +1,11 @@
 #ifndef STARTTREE_HPP
 #define STARTTREE_HPP
 
+#include <numeric>
+
 #include "objective_function.hpp"
+#include "eval_trees.hpp"
+#include "score_delta.hpp"
 
 Tree random_tree_from_leaves(std::vector<std::string>& leaves) {
     // Define simple Tree structure
@@ -59,58 +63,116 @@ Tree random_tree_from_leaves(std::vector<std::string>& leaves) {
     return tree;
 }
 
-Tree random_tree(const std::string &evalTreesPath) {
-    // Get set of node names
-    std::vector<std::string> leaves = leafNames(evalTreesPath);
-
-    std::shuffle(leaves.begin(), leaves.end(), Random::getMT());
+Tree random_tree(const EvalTrees& evalTrees) {
+    std::vector<std::string> leaves = evalTrees.taxa();
+    std::shuffle(leaves.begin(), leaves.end(), Random::engine());
     return random_tree_from_leaves(leaves);
 }
 
 
+// Inserts the leaf of taxon lname where it increases the objective most and returns the increase.
+// The insertion points are scored from the quartet counts with score_insertions, on the tree as
+// it is, instead of scoring a copy of the tree per candidate edge. The candidates are scored by all
+// threads; ties go to the lowest edge index, so the result does not depend on the thread count.
+// supports carries the edge supports from one step to the next and starts out empty for a tree.
 template<typename CINT>
-Tree stepwise_addition_tree_from_leaves(QuartetScoreComputer<CINT>& qsc, std::vector<std::string>& leaves, size_t m, ObjectiveFunction objective) {
-    Functions<CINT> functions = Functions<CINT>(objective);
+double stepwise_addition_step(Tree& tree, const QuartetCounts<CINT>& counts, const std::string& lname, ObjectiveFunction objective,
+                              std::vector<double>& gain, InsertionSupports& supports) {
+    CompactTree compact(tree);
+    DeltaScorer<CINT> scorer(tree, counts, objective);
+    score_insertions(compact, counts.taxon_id(lname), scorer, gain, nullptr, nullptr, &supports);
+    size_t best = 0;
+    for (size_t i = 1; i < gain.size(); ++i) {
+        if (gain[i] > gain[best]) best = i;
+    }
+    add_new_node(tree, tree.edge_at(best)).
+        secondary_link().node().data_cast<DefaultNodeData>()->name = lname;
+    supports.insert(compact, best);
+    return gain[best];
+}
 
+// Tree of the last three leaves, which are removed from leaves.
+Tree stepwise_addition_initial_tree(std::vector<std::string>& leaves) {
     std::string newick = "(" + leaves[leaves.size()-1] + "," + leaves[leaves.size()-2] + "," + leaves[leaves.size()-3] + ");";
     leaves.pop_back(); leaves.pop_back(); leaves.pop_back();
-    Tree tree = DefaultTreeNewickReader().from_string(newick);
+    return DefaultTreeNewickReader().from_string(newick);
+}
 
+// Inserts the leaves one by one (from the back) where they increase the objective most.
+template<typename CINT>
+Tree stepwise_addition_tree_from_leaves(const QuartetCounts<CINT>& counts, std::vector<std::string>& leaves, ObjectiveFunction objective) {
+    Tree tree = stepwise_addition_initial_tree(leaves);
+
+    std::vector<double> gain;
+    InsertionSupports supports;
     while (!leaves.empty()) {
         std::string lname = leaves.back();
         leaves.pop_back();
-        LOG_DBG << "insert " << lname << std::endl;
-
-        Tree best;
-        double max = std::numeric_limits<double>::lowest();
-        for (size_t i = 0; i < tree.edge_count(); ++i) {
-            LOG_DBG << "leaves left: " << leaves.size() << " edge " << i << "/" << tree.edge_count() << std::endl;
-            Tree tnew = Tree(tree);
-            add_new_node(tnew, tnew.edge_at(i)).
-                secondary_link().node().data_cast<DefaultNodeData>()->name = lname;
-
-            LOG_DBG << "valid tnew:  " << validate_topology(tnew) << std::endl;
-
-            qsc.recomputeScores(tnew, false);
-            //double sum = sum_lqic_scores(qsc);
-            double sum = functions.obj_fun(qsc);
-            LOG_DBG << "sum scores " << sum << std::endl;
-            if (sum > max) {
-                best = tnew;
-                max = sum;
-            }
-        }
-        tree = best;
+        LOG_DBG << "insert " << lname << ", leaves left: " << leaves.size() << std::endl;
+        stepwise_addition_step(tree, counts, lname, objective, gain, supports);
     }
 
     return tree;
 }
 
+// The given order of leaves followed by orders-1 random ones.
+std::vector<std::vector<std::string> > stepwise_addition_orders(const std::vector<std::string>& leaves, size_t orders) {
+    std::vector<std::vector<std::string> > order(orders, leaves);
+    for (size_t k = 1; k < orders; ++k) std::shuffle(order[k].begin(), order[k].end(), Random::engine());
+    return order;
+}
+
+// Stepwise addition for the orders of stepwise_addition_orders, in lockstep: every step inserts the
+// next leaf of each remaining order, the orders in parallel. After each step, an order more than
+// margin behind the best one at that number of leaves is abandoned. The given order is never
+// abandoned, so the result is at least as good as plain stepwise addition. Ties go to the lower
+// order, and as the bound only changes between steps, the result does not depend on the thread count.
+template<typename CINT>
+Tree multi_order_stepwise_addition_tree(const QuartetCounts<CINT>& counts, const std::vector<std::string>& leaves, ObjectiveFunction objective, size_t orders, double margin) {
+    std::vector<std::vector<std::string> > order = stepwise_addition_orders(leaves, orders);
+    std::vector<Tree> tree(orders);
+    std::vector<std::vector<double> > gain(orders);
+    std::vector<InsertionSupports> supports(orders);
+    std::vector<double> score(orders, 0);
+    std::vector<size_t> active(orders);
+    for (size_t k = 0; k < orders; ++k) {
+        tree[k] = stepwise_addition_initial_tree(order[k]);
+        active[k] = k;
+    }
+
+    // Order 0 stays active, so its remaining leaves are those of every active order.
+    while (!order[0].empty()) {
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < active.size(); ++i) {
+            const size_t k = active[i];
+            score[k] += stepwise_addition_step(tree[k], counts, order[k].back(), objective, gain[k], supports[k]);
+            order[k].pop_back();
+        }
+
+        double lead = std::numeric_limits<double>::lowest();
+        for (size_t k : active) lead = std::max(lead, score[k]);
+        size_t kept = 0;
+        for (size_t k : active) {
+            if (k == 0 or score[k] >= lead - margin) active[kept++] = k;
+            else LOG_DBG << "order " << k << " abandoned with " << order[k].size() << " leaves left" << std::endl;
+        }
+        active.resize(kept);
+    }
+
+    size_t best = active[0];
+    for (size_t k : active) {
+        if (score[k] > score[best]) best = k;
+    }
+    LOG_INFO << "Stepwise addition: best of " << orders << " orders is " << best << ", "
+             << orders - active.size() << " abandoned." << std::endl;
+    return tree[best];
+}
+
 template<typename CINT>
-Tree stepwise_addition_tree(const std::string &evalTreesPath, size_t m, ObjectiveFunction objective) {
-    std::vector<std::string> leaves = leafNames(evalTreesPath);
-    std::shuffle(leaves.begin(), leaves.end(), Random::getMT());
-    return stepwise_addition_tree_from_leaves<CINT>-(evalTreesPath, leaves, m, objective);
+Tree stepwise_addition_tree(const QuartetCounts<CINT>& counts, ObjectiveFunction objective) {
+    std::vector<std::string> leaves = counts.dictionary().names();
+    std::shuffle(leaves.begin(), leaves.end(), Random::engine());
+    return stepwise_addition_tree_from_leaves<CINT>(counts, leaves, objective);
 }
 
 
@@ -119,68 +181,179 @@ uint64_t treecount(uint64_t n) {
     return treecount(n-1) * (2*n-5);
 }
 
-template<typename CINT>
-void _rec_exhaustive_search(Tree& tree, Tree& best, std::vector<std::string>& leaves, int li, QuartetScoreComputer<CINT>& qsc, double& max, int& c, ObjectiveFunction objective) {
-    Functions<CINT> functions = Functions<CINT>(objective);
-    if (li < 0) {
-        qsc.recomputeScores(tree, false);
-        //double sum = sum_lqic_scores(qsc);
-        double sum = functions.obj_fun(qsc);
-        if (sum > max) {
-            max = sum;
-            best = tree;
-        } 
-        c++;
-        auto tc = treecount(leaves.size()+3);
-        auto oneP = tc/100;
-        if (c % oneP == 0) std::cout << c << "/" << treecount(leaves.size()+3) << "\n";
-        return;
-    }
+// Newick string of tree, whose leaves have the taxa node_taxa.
+inline std::string compact_tree_newick(const CompactTree& tree, const std::vector<size_t>& node_taxa, const TaxonDictionary& taxa) {
+    std::function<std::string(size_t)> subtree = [&](size_t l) {
+        const size_t n = tree.link_node(tree.outer(l));
+        if (tree.is_leaf(n)) return taxa.name(node_taxa[n]);
+        std::string str = "(";
+        for (size_t c = tree.next(tree.outer(l)); c != tree.outer(l); c = tree.next(c)) {
+            if (str.size() > 1) str += ',';
+            str += subtree(c);
+        }
+        return str + ')';
+    };
+    size_t root = 0;
+    while (!tree.is_root(root)) ++root;
+    std::string newick = "(";
+    size_t l = tree.node_link(root);
+    do {
+        if (newick.size() > 1) newick += ',';
+        newick += subtree(l);
+        l = tree.next(l);
+    } while (l != tree.node_link(root));
+    return newick + ");";
+}
 
-    for (size_t i = 0; i < tree.edge_count(); ++i) {
-        Tree tnew = Tree(tree);
-        add_new_node(tnew, tnew.edge_at(i)).
-            secondary_link().node().data_cast<DefaultNodeData>()->name = leaves[li];
-        _rec_exhaustive_search(tnew, best, leaves, li-1, qsc, max, c, objective);
-    }
+// Upper bound on the objective of every tree a partial tree can grow into, given the scores of its
+// inner edges and the number of taxa still to insert. Inserting a taxon elsewhere only adds
+// quartets to an edge, which cannot raise its LQIC. Each insertion replaces at most one edge, and
+// the complete tree has taxa-3 inner edges, none scoring more than 1. So at best the lowest edges
+// are replaced and all other edges of the complete tree score 1. QPIC and EQPIC can rise when
+// quartets are added, so for them only the trivial bound is left.
+inline double exhaustive_search_bound(ObjectiveFunction objective, std::vector<double> scores, size_t left, size_t innerEdges) {
+    if (objective != LQIC) return innerEdges;
+    std::sort(scores.begin(), scores.end());
+    double bound = 0;
+    size_t kept = 0;
+    for (size_t i = std::min(left, scores.size()); i < scores.size(); ++i, ++kept) bound += std::min(scores[i], 1.0);
+    return bound + (innerEdges - kept);
 }
 
+// State shared by the tasks of exhaustive_search_from_leaves.
 template<typename CINT>
-Tree exhaustive_search_from_leaves(const std::string &evalTreesPath, std::vector<std::string>& leaves, size_t m, ObjectiveFunction objective) {
-
-    std::string newick = "(" + leaves[leaves.size()-1] + "," + leaves[leaves.size()-2] + "," + leaves[leaves.size()-3] + ");";
-    leaves.pop_back(); leaves.pop_back(); leaves.pop_back();
-    Tree tree = DefaultTreeNewickReader().from_string(newick);
+struct ExhaustiveSearch {
+    const QuartetCounts<CINT>& counts;
+    // Taxon ids in the order of insertion.
+    std::vector<size_t> order;
+    double best;
+    Tree bestTree;
+    // Newick of bestTree, empty while it is the stepwise addition tree. Trees of equal objective
+    // are ranked by it, so ties do not go to whichever task got there first.
+    std::string bestNewick;
+    uint64_t trees;
+    uint64_t pruned;
+};
 
-    Tree precalc_tree(tree);
-    for (int i = leaves.size()-1; i >= 0; --i) {
-        LOG_DBG << leaves[i] << std::endl;
-        add_new_node(precalc_tree,
-                     precalc_tree.edge_at(Random::get_rand_int(0, precalc_tree.edge_count()-1))).
-            secondary_link().node().data_cast<DefaultNodeData>()->name = leaves[i];
+template<typename CINT>
+void _rec_exhaustive_search(CompactTree& tree, DeltaScorer<CINT>& scorer, size_t next, ExhaustiveSearch<CINT>& search) {
+    const size_t x = search.order[next];
+    const bool last = next + 1 == search.order.size();
+    std::vector<double> gain, scores;
+    std::vector<std::vector<double> > child_scores;
+    score_insertions(tree, x, scorer, gain, &scores, last ? nullptr : &child_scores);
+
+    double best;
+    #pragma omp atomic read
+    best = search.best;
+    const double current = std::accumulate(scores.begin(), scores.end(), 0.0);
+
+    // Most promising insertions first, so that good trees tighten the bound early.
+    std::vector<size_t> edges(gain.size());
+    for (size_t f = 0; f < edges.size(); ++f) edges[f] = f;
+    std::stable_sort(edges.begin(), edges.end(), [&](size_t a, size_t b) { return gain[a] > gain[b]; });
+
+    if (last) {
+        #pragma omp atomic
+        search.trees += edges.size();
+        const size_t f = edges[0];
+        if (current + gain[f] < best) return;
+        tree.insert_leaf(f);
+        scorer.node_taxa.push_back(search.counts.taxon_count());
+        scorer.node_taxa.push_back(x);
+        const std::string newick = compact_tree_newick(tree, scorer.node_taxa, search.counts.dictionary());
+        #pragma omp critical(exhaustive_best)
+        if (current + gain[f] > search.best or
+            (current + gain[f] == search.best and (search.bestNewick.empty() or newick < search.bestNewick))) {
+            #pragma omp atomic write
+            search.best = current + gain[f];
+            search.bestTree = DefaultTreeNewickReader().from_string(newick);
+            search.bestNewick = newick;
+        }
+        tree.remove_leaf();
+        scorer.node_taxa.resize(scorer.node_taxa.size() - 2);
+        return;
     }
-    QuartetScoreComputer<CINT> qsc(precalc_tree, evalTreesPath, m, true, true);
 
-    double max = -2.0 * leaves.size();
-    Tree best = tree;
-    int c = 0;
-
-    for (size_t i = 0; i < tree.edge_count(); ++i) {
-        Tree tnew = Tree(tree);
-        add_new_node(tnew, tnew.edge_at(i)).
-            secondary_link().node().data_cast<DefaultNodeData>()->name = leaves[leaves.size()-1];
-        _rec_exhaustive_search(tnew, best, leaves, leaves.size()-2, qsc, max, c, objective);
+    // The first two levels are spread over the threads as tasks, each on its own copy.
+    const bool spawn = next < 5;
+    const CompactTree* parent_tree = &tree;
+    const DeltaScorer<CINT>* parent_scorer = &scorer;
+    ExhaustiveSearch<CINT>* shared_search = &search;
+    for (size_t f : edges) {
+        // Children are bounded from the scores of the parent, before they are built. Only children
+        // that cannot reach the best objective are cut off, ties are still compared.
+        #pragma omp atomic read
+        best = search.best;
+        if (exhaustive_search_bound(scorer.objective, child_scores[f], search.order.size() - next - 1,
+                                    search.order.size() - 3) < best) {
+            #pragma omp atomic
+            search.pruned++;
+            continue;
+        }
+        if (spawn) {
+            #pragma omp task firstprivate(f, parent_tree, parent_scorer, shared_search)
+            {
+                CompactTree local_tree(*parent_tree);
+                DeltaScorer<CINT> local_scorer(*parent_scorer);
+                local_tree.insert_leaf(f);
+                local_scorer.node_taxa.push_back(shared_search->counts.taxon_count());
+                local_scorer.node_taxa.push_back(x);
+                _rec_exhaustive_search(local_tree, local_scorer, next + 1, *shared_search);
+            }
+            continue;
+        }
+        tree.insert_leaf(f);
+        scorer.node_taxa.push_back(search.counts.taxon_count());
+        scorer.node_taxa.push_back(x);
+        _rec_exhaustive_search(tree, scorer, next + 1, search);
+        tree.remove_leaf();
+        scorer.node_taxa.resize(scorer.node_taxa.size() - 2);
+    }
+    if (spawn) {
+        #pragma omp taskwait
     }
+}
 
-    return best;
+// Tree with the best objective over all topologies of the leaves, by branch and bound: leaves are
+// inserted in place in the order given (from the back), every level is scored with
+// score_insertions and partial trees whose bound cannot beat the best tree so far are cut off.
+// The stepwise addition tree for the same order is the first best tree. Of the trees with the best
+// objective, the one with the smallest Newick string is returned, whatever the thread count.
+template<typename CINT>
+Tree exhaustive_search_from_leaves(const QuartetCounts<CINT>& counts, std::vector<std::string>& leaves, ObjectiveFunction objective) {
+    ExhaustiveSearch<CINT> search = { counts, std::vector<size_t>(), 0, Tree(), std::string(), 0, 0 };
+    for (auto it = leaves.rbegin(); it != leaves.rend(); ++it) search.order.push_back(counts.taxon_id(*it));
+
+    std::vector<std::string> stepwise_leaves(leaves);
+    Tree tree = stepwise_addition_initial_tree(stepwise_leaves);
+    search.bestTree = tree;
+    std::vector<double> gain;
+    InsertionSupports supports;
+    while (!stepwise_leaves.empty()) {
+        search.best += stepwise_addition_step(search.bestTree, counts, stepwise_leaves.back(), objective, gain, supports);
+        stepwise_leaves.pop_back();
+    }
+    if (search.order.size() == 3) return search.bestTree;
+
+    CompactTree compact(tree, search.order.size() - 3);
+    DeltaScorer<CINT> scorer(tree, counts, objective);
+    #pragma omp parallel
+    #pragma omp single
+    _rec_exhaustive_search(compact, scorer, 3, search);
+
+    LOG_INFO << "Exhaustive search: " << search.trees << " of " << treecount(search.order.size())
+             << " trees scored, " << search.pruned << " partial trees cut off." << std::endl;
+    leaves.clear();
+    return search.bestTree;
 }
 
 
 template<typename CINT>
-Tree exhaustive_search(const std::string &evalTreesPath, size_t m, ObjectiveFunction objective) {
-    std::vector<std::string> leaves = leafNames(evalTreesPath);
-    std::shuffle(leaves.begin(), leaves.end(), Random::getMT());
-    return exhaustive_search_from_leaves<CINT>(evalTreesPath, leaves, m, objective);
+Tree exhaustive_search(const QuartetCounts<CINT>& counts, ObjectiveFunction objective) {
+    std::vector<std::string> leaves = counts.dictionary().names();
+    std::shuffle(leaves.begin(), leaves.end(), Random::engine());
+    return exhaustive_search_from_leaves<CINT>(counts, leaves, objective);
 }
 
 
@@ -0,0 +1,56 @@
+#ifndef SYMMETRIC_MATRIX_HPP
+#define SYMMETRIC_MATRIX_HPP
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Allocator for cache line aligned storage.
+template<typename T, size_t ALIGN = 64>
+struct AlignedAllocator {
+    typedef T value_type;
+    template<typename U> struct rebind { typedef AlignedAllocator<U, ALIGN> other; };
+
+    AlignedAllocator() {}
+    template<typename U> AlignedAllocator(const AlignedAllocator<U, ALIGN>&) {}
+
+    T* allocate(size_t n) {
+        void* p = nullptr;
+        if (posix_memalign(&p, ALIGN, n * sizeof(T)) != 0) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) { free(p); }
+};
+template<typename T, typename U, size_t ALIGN>
+bool operator==(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&) { return true; }
+template<typename T, typename U, size_t ALIGN>
+bool operator!=(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&) { return false; }
+
+// n x n symmetric matrix, stored as the upper triangle including the diagonal in one contiguous
+// block. Row i holds (i,i) .. (i,n-1), so the part of a row right of the diagonal is contiguous.
+template<typename T>
+class SymmetricMatrix {
+public:
+    SymmetricMatrix() : n(0) {}
+    explicit SymmetricMatrix(size_t _n, T value = T()) : n(_n), data(_n * (_n + 1) / 2, value) {}
+
+    size_t size() const { return n; }
+
+    T& operator()(size_t i, size_t j) { return data[index(i, j)]; }
+    const T& operator()(size_t i, size_t j) const { return data[index(i, j)]; }
+
+    // Entries (i,i) .. (i,n-1).
+    T* upper_row(size_t i) { return &data[index(i, i)]; }
+    const T* upper_row(size_t i) const { return &data[index(i, i)]; }
+
+private:
+    size_t n;
+    std::vector<T, AlignedAllocator<T> > data;
+
+    size_t index(size_t i, size_t j) const {
+        if (i > j) std::swap(i, j);
+        return i * n - i * (i - 1) / 2 + (j - i);
+    }
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef TAXON_DICTIONARY_HPP
+#define TAXON_DICTIONARY_HPP
+
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "utils.hpp"
+
+// Dense integer ids for the taxa of a run, assigned once when the evaluation trees are read. Ids
+// are positions in the sorted list of names, so every stage of the run agrees on them. Names are
+// only looked up at the boundaries (reading a tree, writing one); node_taxa() gives the ids of all
+// nodes of a tree at once so that the stages themselves compare integers.
+class TaxonDictionary {
+public:
+    TaxonDictionary() {}
+    explicit TaxonDictionary(const std::vector<std::string>& sortedNames);
+
+    size_t size() const { return names_.size(); }
+    const std::vector<std::string>& names() const { return names_; }
+    const std::string& name(size_t id) const { return names_[id]; }
+    bool contains(const std::string& name) const { return ids.count(name) > 0; }
+    size_t id(const std::string& name) const;
+
+    // Taxon id of every node of tree, size() for inner nodes.
+    std::vector<size_t> node_taxa(const Tree& tree) const;
+
+    bool operator==(const TaxonDictionary& other) const { return names_ == other.names_; }
+    bool operator!=(const TaxonDictionary& other) const { return names_ != other.names_; }
+
+private:
+    std::vector<std::string> names_;
+    std::unordered_map<std::string, size_t> ids;
+};
+
+TaxonDictionary::TaxonDictionary(const std::vector<std::string>& sortedNames) : names_(sortedNames) {
+    ids.reserve(names_.size());
+    for (size_t i = 0; i < names_.size(); ++i) ids[names_[i]] = i;
+}
+
+size_t TaxonDictionary::id(const std::string& name) const {
+    auto it = ids.find(name);
+    if (it == ids.end()) throw std::runtime_error("Unknown taxon " + name);
+    return it->second;
+}
+
+std::vector<size_t> TaxonDictionary::node_taxa(const Tree& tree) const {
+    std::vector<size_t> res(tree.node_count(), size());
+    for (size_t i = 0; i < tree.node_count(); ++i) {
+        if (tree.node_at(i).is_leaf()) res[i] = id(tree.node_at(i).data<DefaultNodeData>().name);
+    }
+    return res;
+}
+
+#endif
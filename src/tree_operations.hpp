@@ -66,42 +66,23 @@ std::vector<std::string> leafNames(const std::string &evalTreesPath) {
     return std::vector<std::string>(leaf_names.begin(), leaf_names.end());
 }
 
+// True if every leaf of the tree with fewer leaves has the same node index in the other tree.
+// Leaf names are unique, so this compares node by node instead of building name maps.
 bool verify_leaf_ids_match(Tree tree1, Tree tree2, bool verbose = false) {
-    std::map<std::string, size_t> leafToID1;
-    std::map<std::string, size_t> leafToID2;
-
-    for (size_t i = 0; i < tree1.node_count(); ++i) {
-        if (tree1.node_at(i).is_leaf())
-            leafToID1[tree1.node_at(i).data<DefaultNodeData>().name] = i;
-    }
-    for (size_t i = 0; i < tree2.node_count(); ++i) {
-        if (tree2.node_at(i).is_leaf())
-            leafToID2[tree2.node_at(i).data<DefaultNodeData>().name] = i;
-    }
+    size_t leaves1 = 0, leaves2 = 0;
+    for (size_t i = 0; i < tree1.node_count(); ++i) leaves1 += tree1.node_at(i).is_leaf();
+    for (size_t i = 0; i < tree2.node_count(); ++i) leaves2 += tree2.node_at(i).is_leaf();
+    const Tree& small = (leaves1 < leaves2) ? tree1 : tree2;
+    const Tree& other = (leaves1 < leaves2) ? tree2 : tree1;
 
     bool ok = true;
-    if (leafToID1.size() < leafToID2.size()) {
-        for (auto it = leafToID1.begin(); it != leafToID1.end(); ++it) {
-            if (leafToID2.find(it->first) == leafToID2.end() or
-                leafToID1[it->first] != leafToID2[it->first]) {
-                if (verbose) {
-                    std::cout << "leafToID1[" << it->first << "] = " << leafToID1[it->first] << " != leafToID2[" << it->first << "] = "  << leafToID2[it->first] << std::endl;
-                } else {
-                    return false;
-                }
-            }
-        }
-    } else {
-        for (auto it = leafToID2.begin(); it != leafToID2.end(); ++it) {
-            if (leafToID1.find(it->first) == leafToID1.end() or
-                leafToID1[it->first] != leafToID2[it->first]) {
-                if (verbose) {
-                    std::cout << "leafToID1[" << it->first << "] = " << leafToID1[it->first] << " != leafToID2[" << it->first << "] = "  << leafToID2[it->first] << std::endl;
-                } else {
-                    return false;
-                }
-            }
-        }
+    for (size_t i = 0; i < small.node_count(); ++i) {
+        if (!small.node_at(i).is_leaf()) continue;
+        const std::string& name = small.node_at(i).data<DefaultNodeData>().name;
+        if (i < other.node_count() and other.node_at(i).is_leaf() and
+            other.node_at(i).data<DefaultNodeData>().name == name) continue;
+        if (!verbose) return false;
+        std::cout << "leaf " << name << " has node index " << i << " in one tree only" << std::endl;
     }
 
     return ok;
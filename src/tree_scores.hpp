@@ -0,0 +1,185 @@
+#ifndef TREE_SCORES_HPP
+#define TREE_SCORES_HPP
+
+#include <cmath>
+#include <limits>
+
+#include "quartet_counts.hpp"
+
+enum ObjectiveFunction { LQIC, QPIC, EQPIC };
+
+// Quartet internode certainty of the topology supported by q1 against the alternatives q2 and q3.
+// Negative if one of the alternatives is supported by more evaluation trees.
+inline double qic(double q1, double q2, double q3) {
+    const double sum = q1 + q2 + q3;
+    if (sum == 0) return 0;
+    double h = 0;
+    for (double q : {q1, q2, q3}) {
+        if (q > 0) h += (q/sum) * log(q/sum);
+    }
+    const double res = 1 + h / log(3);
+    return (q1 < q2 or q1 < q3) ? -res : res;
+}
+
+// Support of an edge accumulated over the quartets its score is computed from: the lowest QIC for
+// LQIC, the summed counts of the three topologies for QPIC and EQPIC. Topology 0 is the one the
+// edge induces.
+struct QuartetSupport {
+    double min;
+    uint64_t q[3];
+
+    QuartetSupport() : min(std::numeric_limits<double>::max()), q{0, 0, 0} {}
+
+    template<typename CINT>
+    void add(ObjectiveFunction objective, const std::array<CINT, 3>& counts) {
+        if (objective == LQIC) min = std::min(min, qic(counts[0], counts[1], counts[2]));
+        else for (size_t i = 0; i < 3; ++i) q[i] += counts[i];
+    }
+
+    double score(ObjectiveFunction objective) const {
+        return (objective == LQIC) ? min : qic(q[0], q[1], q[2]);
+    }
+};
+
+// Adds the EQPIC support of quartet ab|cd. Which of the two alternatives is which must not depend
+// on the order the taxa are enumerated in, so both pairs are ordered by taxon id.
+template<typename CINT>
+void add_split_quartet(const QuartetCounts<CINT>& counts, size_t a, size_t b, size_t c, size_t d, QuartetSupport& support) {
+    if (a > b) std::swap(a, b);
+    if (c > d) std::swap(c, d);
+    support.add(EQPIC, counts.get(a, b, c, d));
+}
+
+// Calls f(u, v) for every pair of distinct taxa of a and b together.
+template<typename F>
+void for_each_pair(const std::vector<size_t>& a, const std::vector<size_t>& b, F f) {
+    for (size_t i = 0; i < a.size(); ++i) for (size_t j = i+1; j < a.size(); ++j) f(a[i], a[j]);
+    for (size_t i = 0; i < b.size(); ++i) for (size_t j = i+1; j < b.size(); ++j) f(b[i], b[j]);
+    for (size_t u : a) for (size_t v : b) f(u, v);
+}
+
+// Adds the quartets of an edge whose sides are a,b | c,d. For EQPIC, any two taxa from each side.
+template<typename CINT>
+void add_quadripartition(const QuartetCounts<CINT>& counts, ObjectiveFunction objective,
+                         const std::vector<size_t>& a, const std::vector<size_t>& b,
+                         const std::vector<size_t>& c, const std::vector<size_t>& d, QuartetSupport& support) {
+    if (objective != EQPIC) {
+        for (size_t x : a) for (size_t y : b) for (size_t u : c) for (size_t v : d)
+            support.add(objective, counts.get(x, y, u, v));
+        return;
+    }
+    for_each_pair(a, b, [&](size_t x, size_t y) {
+        for_each_pair(c, d, [&](size_t u, size_t v) { add_split_quartet(counts, x, y, u, v, support); });
+    });
+}
+
+// Appends the taxa of the subtree that `link` leads into. stack is scratch space.
+inline void subtree_taxa(const TreeLink& link, const std::vector<size_t>& node_taxa, std::vector<size_t>& out,
+                         std::vector<const TreeLink*>& stack) {
+    stack.assign(1, &link.outer());
+    while (!stack.empty()) {
+        const TreeLink* l = stack.back();
+        stack.pop_back();
+        if (l->node().is_leaf()) {
+            out.push_back(node_taxa[l->node().index()]);
+            continue;
+        }
+        for (const TreeLink* n = &l->next(); n != l; n = &n->next()) stack.push_back(&n->outer());
+    }
+}
+
+// LQIC, QPIC and EQPIC of every edge of a tree, computed from a quartet count table the object
+// only reads. Copies share the table, so a copy per thread or per chain costs three score vectors.
+// Leaf edges hold NO_SCORE, which lies outside [-1,1] and is skipped by the sums.
+//
+// The per-edge updates take the tree of the last recomputeScores or one derived from it by NNI
+// and SPR moves, which keep node indices.
+template<typename CINT>
+class TreeScores {
+public:
+    static constexpr double NO_SCORE = std::numeric_limits<double>::infinity();
+
+    // Without a tree, all vectors are empty until the first recomputeScores.
+    explicit TreeScores(const QuartetCounts<CINT>& _counts) : counts(&_counts) {}
+    TreeScores(const Tree& tree, const QuartetCounts<CINT>& _counts) : counts(&_counts) { recomputeScores(tree); }
+
+    // Scores all edges, in parallel.
+    void recomputeScores(const Tree& tree) {
+        node_taxa = counts->node_taxa(tree);
+        const size_t E = tree.edge_count();
+        lqic.assign(E, NO_SCORE);
+        qpic.assign(E, NO_SCORE);
+        eqpic.assign(E, NO_SCORE);
+        // The per-edge updates reuse scratch, which is sized for the whole tree here.
+        for (std::vector<size_t>& sub : scratch.sub) sub.reserve(counts->taxon_count());
+        scratch.stack.reserve(tree.node_count());
+        #pragma omp parallel
+        {
+            Scratch local;
+            #pragma omp for schedule(dynamic)
+            for (size_t e = 0; e < E; ++e) {
+                if (!collect(tree, e, local)) continue;
+                QuartetSupport pattern, split;
+                // LQIC and QPIC are taken over the same quartets, so one pass gives both.
+                for (size_t x : local.sub[0]) for (size_t y : local.sub[1]) for (size_t u : local.sub[2]) for (size_t v : local.sub[3]) {
+                    const std::array<CINT, 3> c = counts->get(x, y, u, v);
+                    pattern.add(LQIC, c);
+                    pattern.add(QPIC, c);
+                }
+                add_quadripartition(*counts, EQPIC, local.sub[0], local.sub[1], local.sub[2], local.sub[3], split);
+                lqic[e] = pattern.score(LQIC);
+                qpic[e] = pattern.score(QPIC);
+                eqpic[e] = split.score(EQPIC);
+            }
+        }
+    }
+
+    void recomputeLqicForEdge(const Tree& tree, size_t e) { lqic[e] = edge_score(tree, e, LQIC); }
+    void recomputeQpicForEdge(const Tree& tree, size_t e) { qpic[e] = edge_score(tree, e, QPIC); }
+    void recomputeEqpicForEdge(const Tree& tree, size_t e) { eqpic[e] = edge_score(tree, e, EQPIC); }
+
+    const std::vector<double>& getLQICScores() const { return lqic; }
+    const std::vector<double>& getQPICScores() const { return qpic; }
+    const std::vector<double>& getEQPICScores() const { return eqpic; }
+
+    void setLQIC(size_t e, double val) { lqic[e] = val; }
+    void setQPIC(size_t e, double val) { qpic[e] = val; }
+    void setEQPIC(size_t e, double val) { eqpic[e] = val; }
+
+    const QuartetCounts<CINT>& quartet_counts() const { return *counts; }
+
+private:
+    struct Scratch {
+        std::vector<size_t> sub[4];
+        std::vector<const TreeLink*> stack;
+    };
+
+    const QuartetCounts<CINT>* counts;
+    std::vector<size_t> node_taxa;
+    std::vector<double> lqic, qpic, eqpic;
+    Scratch scratch;
+
+    // Taxa of the four subtrees around e, false for a leaf edge.
+    bool collect(const Tree& tree, size_t e, Scratch& s) const {
+        const TreeLink& p = tree.edge_at(e).primary_link();
+        const TreeLink& q = tree.edge_at(e).secondary_link();
+        if (p.node().is_leaf() or q.node().is_leaf()) return false;
+        const TreeLink* around[4] = { &p.next(), &p.next().next(), &q.next(), &q.next().next() };
+        for (size_t i = 0; i < 4; ++i) {
+            s.sub[i].clear();
+            subtree_taxa(*around[i], node_taxa, s.sub[i], s.stack);
+        }
+        return true;
+    }
+
+    double edge_score(const Tree& tree, size_t e, ObjectiveFunction objective) {
+        if (!collect(tree, e, scratch)) return NO_SCORE;
+        QuartetSupport support;
+        add_quadripartition(*counts, objective, scratch.sub[0], scratch.sub[1], scratch.sub[2], scratch.sub[3], support);
+        return support.score(objective);
+    }
+};
+
+template<typename CINT> constexpr double TreeScores<CINT>::NO_SCORE;
+
+#endif
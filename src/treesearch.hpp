@@ -238,7 +238,7 @@ Tree random_tree(const std::string &evalTreesPath) {
     // Get set of node names
     std::vector<std::string> leaves = leafNames(evalTreesPath);
 
-    std::shuffle(leaves.begin(), leaves.end(), Random::getMT());
+    std::shuffle(leaves.begin(), leaves.end(), Random::engine());
     return random_tree_from_leaves(leaves);
 }
 
@@ -297,7 +297,7 @@ Tree stepwise_addition_tree_from_leaves(const std::string &evalTreesPath, std::v
 template<typename CINT>
 Tree stepwise_addition_tree(const std::string &evalTreesPath, size_t m) {
     std::vector<std::string> leaves = leafNames(evalTreesPath);
-    std::shuffle(leaves.begin(), leaves.end(), Random::getMT());
+    std::shuffle(leaves.begin(), leaves.end(), Random::engine());
     return stepwise_addition_tree_from_leaves<CINT>-(evalTreesPath, leaves, m);
 }
 
@@ -471,7 +471,7 @@ Tree exhaustive_search_from_leaves(const std::string &evalTreesPath, std::vector
 template<typename CINT>
 Tree exhaustive_search(const std::string &evalTreesPath, size_t m) {
     std::vector<std::string> leaves = leafNames(evalTreesPath);
-    std::shuffle(leaves.begin(), leaves.end(), Random::getMT());
+    std::shuffle(leaves.begin(), leaves.end(), Random::engine());
     return exhaustive_search_from_leaves<CINT>(evalTreesPath, leaves, m);
 }
 
@@ -4,26 +4,18 @@
 #define DO_PRAGMA(x) _Pragma (#x)
 #define TODO(x) DO_PRAGMA(message ("TODO - " #x))
 
-#include "QuartetScoreComputer.hpp"
+#include "genesis/genesis.hpp"
+using namespace genesis;
+using namespace genesis::tree;
+
+#include "tree_scores.hpp"
 #include "nni.hpp"
 #include "spr.hpp"
 
-size_t countEvalTrees(const std::string &evalTreesPath);
 std::string print_help(TreeNode const& node,TreeEdge const& edge);
 std::string print_data(TreeNode const& node,TreeEdge const& edge);
 void print_tree_with_lqic(Tree& tree, const std::vector<double>& lqic);
 
-size_t countEvalTrees(const std::string &evalTreesPath) {
-    size_t count = 0;
-    utils::InputStream instream(utils::make_unique<utils::FileInputSource>(evalTreesPath));
-    auto it = NewickInputIterator(instream);
-    while (it) {
-        count++;
-        ++it;
-    }
-    return count;
-}
-
 std::string print_help(TreeNode const& node,TreeEdge const& edge) {
     std::string out = node.data<DefaultNodeData>().name;
     out += " ";
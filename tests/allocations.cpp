@@ -0,0 +1,30 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Heap allocations of the test binary so far, for tests that check a hot path does not allocate.
+// Every replaceable form of new and delete is defined, so each new is paired with its own delete.
+// They live apart from the tests so that the compiler does not inline them into their callers.
+std::atomic<size_t> allocations(0);
+
+static void* counted_malloc(size_t size) noexcept {
+    ++allocations;
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) {
+    if (void* p = counted_malloc(size)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return counted_malloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return counted_malloc(size); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+#endif
@@ -9,6 +9,16 @@ using namespace genesis::tree;
 #include "spr.hpp"
 #include "../externals/generator/generator.hpp"
 #include "starttree.hpp"
+#include "reduce_tree.hpp"
+#include "greedy.hpp"
+#include "move_journal.hpp"
+#include "simulated_annealing.hpp"
+#include "replicates.hpp"
+
+#include <atomic>
+
+// Heap allocations of the test binary so far, counted in allocations.cpp.
+extern std::atomic<size_t> allocations;
 
 void test_tree_manipulation(
     std::string newickIn, std::string newickExpected, std::function<Tree(Tree)> manipulateTree) {
@@ -22,6 +32,20 @@ void test_tree_manipulation(
     REQUIRE(newickOut == newickExpected);
 }
 
+// Same topology with the same leaf names; edge indices and branch data are not compared.
+bool equal_topology(const Tree& a, const Tree& b) {
+    auto node_comparator = [] (TreeNode const& node_l,TreeNode const& node_r) {return node_r.data<DefaultNodeData>().name == node_l.data<DefaultNodeData>().name; };
+    auto edge_comparator = [] (TreeEdge const& edge_l,TreeEdge const& edge_r) {(void) edge_l; (void) edge_r; return true;};
+    return genesis::tree::equal(a, b, node_comparator, edge_comparator);
+}
+
+// Quartet counts of the yeast evaluation trees, counted once for all tests.
+const QuartetCounts<uint64_t>& yeast_counts() {
+    static EvalTrees evalTrees("../tests/data/yeast_all.tre");
+    static QuartetCounts<uint64_t> counts(evalTrees);
+    return counts;
+}
+
 TEST_CASE("nni_a") {
     test_tree_manipulation("((A,B),C,D);", "((A,C),B,D);",
          [](Tree tree) { return nni_a(tree, tree.root_link().edge().index()); });
@@ -63,15 +87,14 @@ TEST_CASE("nni_b_reverse") {
 
 TEST_CASE("LQIC after NNI") {
     Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
     size_t e = 2;
     while (tree.edge_at(e).secondary_link().is_leaf()) ++e;
 
     SECTION("nni_a"){
         nni_a_with_lqic_update<uint64_t>(tree, e, qsc);
         std::vector<double> lqic1 = qsc.getLQICScores();
-        qsc.recomputeScores(tree, false);
+        qsc.recomputeScores(tree);
         std::vector<double> lqic2 = qsc.getLQICScores();
         REQUIRE(lqic1 == lqic2);
 
@@ -81,7 +104,7 @@ TEST_CASE("LQIC after NNI") {
             std::cout << "edge: " << e << std::endl;
             nni_a_with_lqic_update<uint64_t>(tree, e, qsc);
             std::vector<double> lqic1 = qsc.getLQICScores();
-            qsc.recomputeScores(tree, false);
+            qsc.recomputeScores(tree);
             std::vector<double> lqic2 = qsc.getLQICScores();
             //REQUIRE(lqic1 == lqic2);
             bool eq = true;
@@ -95,7 +118,7 @@ TEST_CASE("LQIC after NNI") {
     SECTION("nni_b"){
         nni_b_with_lqic_update<uint64_t>(tree, e, qsc);
         std::vector<double> lqic1 = qsc.getLQICScores();
-        qsc.recomputeScores(tree, false);
+        qsc.recomputeScores(tree);
         std::vector<double> lqic2 = qsc.getLQICScores();
         REQUIRE(lqic1 == lqic2);
 
@@ -105,7 +128,7 @@ TEST_CASE("LQIC after NNI") {
             std::cout << "edge: " << e << std::endl;
             nni_b_with_lqic_update<uint64_t>(tree, e, qsc);
             std::vector<double> lqic1 = qsc.getLQICScores();
-            qsc.recomputeScores(tree, false);
+            qsc.recomputeScores(tree);
             std::vector<double> lqic2 = qsc.getLQICScores();
             //REQUIRE(lqic1 == lqic2);
             bool eq = true;
@@ -119,15 +142,14 @@ TEST_CASE("LQIC after NNI") {
 
 TEST_CASE("QPIC after NNI") {
     Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
     size_t e = 2;
     while (tree.edge_at(e).secondary_link().is_leaf()) ++e;
 
     SECTION("nni_a"){
         nni_a_with_qpic_update<uint64_t>(tree, e, qsc);
         std::vector<double> qpic1 = qsc.getQPICScores();
-        qsc.recomputeScores(tree, false);
+        qsc.recomputeScores(tree);
         std::vector<double> qpic2 = qsc.getQPICScores();
         //REQUIRE(qpic1 == qpic2);
         bool eq = true;
@@ -142,7 +164,7 @@ TEST_CASE("QPIC after NNI") {
             std::cout << "edge: " << e << std::endl;
             nni_a_with_qpic_update<uint64_t>(tree, e, qsc);
             std::vector<double> qpic1 = qsc.getQPICScores();
-            qsc.recomputeScores(tree, false);
+            qsc.recomputeScores(tree);
             std::vector<double> qpic2 = qsc.getQPICScores();
             //REQUIRE(qpic1 == qpic2);
             bool eq = true;
@@ -157,7 +179,7 @@ TEST_CASE("QPIC after NNI") {
         std::cout << "edge: " << e << std::endl;
         nni_b_with_qpic_update<uint64_t>(tree, e, qsc);
         std::vector<double> qpic1 = qsc.getQPICScores();
-        qsc.recomputeScores(tree, false);
+        qsc.recomputeScores(tree);
         std::vector<double> qpic2 = qsc.getQPICScores();
         //REQUIRE(qpic1 == qpic2);
         bool eq = true;
@@ -172,7 +194,7 @@ TEST_CASE("QPIC after NNI") {
             std::cout << "edge: " << e << std::endl;
             nni_b_with_qpic_update<uint64_t>(tree, e, qsc);
             std::vector<double> qpic1 = qsc.getQPICScores();
-            qsc.recomputeScores(tree, false);
+            qsc.recomputeScores(tree);
             std::vector<double> qpic2 = qsc.getQPICScores();
             //REQUIRE(qpic1 == qpic2);
             bool eq = true;
@@ -186,15 +208,14 @@ TEST_CASE("QPIC after NNI") {
 
 TEST_CASE("EQPIC after NNI") {
     Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
     size_t e = 2;
     while (tree.edge_at(e).secondary_link().is_leaf()) ++e;
 
     SECTION("nni_a"){
         nni_a_with_eqpic_update<uint64_t>(tree, e, qsc);
         std::vector<double> eqpic1 = qsc.getEQPICScores();
-        qsc.recomputeScores(tree, false);
+        qsc.recomputeScores(tree);
         std::vector<double> eqpic2 = qsc.getEQPICScores();
         //REQUIRE(eqpic1 == eqpic2);
         bool eq = true;
@@ -209,7 +230,7 @@ TEST_CASE("EQPIC after NNI") {
             std::cout << "edge: " << e << std::endl;
             nni_a_with_eqpic_update<uint64_t>(tree, e, qsc);
             std::vector<double> eqpic1 = qsc.getEQPICScores();
-            qsc.recomputeScores(tree, false);
+            qsc.recomputeScores(tree);
             std::vector<double> eqpic2 = qsc.getEQPICScores();
             //REQUIRE(eqpic1 == eqpic2);
             bool eq = true;
@@ -224,7 +245,7 @@ TEST_CASE("EQPIC after NNI") {
         std::cout << "edge: " << e << std::endl;
         nni_b_with_eqpic_update<uint64_t>(tree, e, qsc);
         std::vector<double> eqpic1 = qsc.getEQPICScores();
-        qsc.recomputeScores(tree, false);
+        qsc.recomputeScores(tree);
         std::vector<double> eqpic2 = qsc.getEQPICScores();
         //REQUIRE(eqpic1 == eqpic2);
         bool eq = true;
@@ -239,7 +260,7 @@ TEST_CASE("EQPIC after NNI") {
             std::cout << "edge: " << e << std::endl;
             nni_b_with_eqpic_update<uint64_t>(tree, e, qsc);
             std::vector<double> eqpic1 = qsc.getEQPICScores();
-            qsc.recomputeScores(tree, false);
+            qsc.recomputeScores(tree);
             std::vector<double> eqpic2 = qsc.getEQPICScores();
             //REQUIRE(eqpic1 == eqpic2);
             bool eq = true;
@@ -274,16 +295,15 @@ TEST_CASE("NNI Generator") {
 TEST_CASE("NNI Generator with LQIC Updates") {
     omp_set_num_threads(1);
     Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
-    QuartetScoreComputer<uint64_t> qsc2 = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+    TreeScores<uint64_t> qsc2(tree, yeast_counts());
     //REQUIRE(qsc.getLQICScores() == qsc2.getLQICScores());
 
     nni_generator_qsc<uint64_t> genNNI(tree, &qsc);
     int c = 0;
     for (Tree t; genNNI(t);) {
         std::cout << "Tree #:" << c++ << std::endl;
-        qsc2.recomputeScores(t, false);
+        qsc2.recomputeScores(t);
         //REQUIRE(qsc.getLQICScores() == qsc2.getLQICScores());
 
         auto lqic1 = qsc.getLQICScores();
@@ -300,18 +320,17 @@ TEST_CASE("NNI Generator with LQIC Updates") {
 TEST_CASE("SPR LQIC update") {
     omp_set_num_threads(1);
     Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
 
     for (size_t i = 0; i < tree.edge_count(); ++i) {
         for (size_t j = 0; j < tree.edge_count(); ++j) {
             if (!validSprMove(tree, i, j)) continue;
-            qsc.recomputeScores(tree, false);
+            qsc.recomputeScores(tree);
             Tree t(tree);
             spr(t, i, j);
             spr_lqic_update(t, i, j, qsc);
             std::vector<double> lqic1 = qsc.getLQICScores();
-            qsc.recomputeScores(t, false);
+            qsc.recomputeScores(t);
             std::vector<double> lqic2 = qsc.getLQICScores();
             //REQUIRE(lqic1 == lqic2);
             bool eq = true;
@@ -324,22 +343,45 @@ TEST_CASE("SPR LQIC update") {
 }
 
 
+TEST_CASE("SPR QPIC update") {
+    omp_set_num_threads(1);
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+
+    for (size_t i = 0; i < tree.edge_count(); ++i) {
+        for (size_t j = 0; j < tree.edge_count(); ++j) {
+            if (!validSprMove(tree, i, j)) continue;
+            qsc.recomputeScores(tree);
+            Tree t(tree);
+            spr(t, i, j);
+            spr_qpic_update(t, i, j, qsc);
+            std::vector<double> qpic1 = qsc.getQPICScores();
+            qsc.recomputeScores(t);
+            std::vector<double> qpic2 = qsc.getQPICScores();
+            bool eq = true;
+            for (size_t k = 0; k < qpic1.size(); ++k) {
+                if (Approx(qpic1[k]) != qpic2[k]) eq = false;
+            }
+            REQUIRE(eq);
+        }
+    }
+}
+
 TEST_CASE("SPR EQPIC update") {
     omp_set_num_threads(1);
     Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
 
     for (size_t i = 0; i < tree.edge_count(); ++i) {
         std::cout << i << "/" << tree.edge_count() << std::endl;
         for (size_t j = 0; j < tree.edge_count(); ++j) {
             if (!validSprMove(tree, i, j)) continue;
-            qsc.recomputeScores(tree, false);
+            qsc.recomputeScores(tree);
             Tree t(tree);
             spr(t, i, j);
             spr_eqpic_update(t, i, j, qsc);
             std::vector<double> eqpic1 = qsc.getEQPICScores();
-            qsc.recomputeScores(t, false);
+            qsc.recomputeScores(t);
             std::vector<double> eqpic2 = qsc.getEQPICScores();
             //REQUIRE(eqpic1 == eqpic2);
             bool eq = true;
@@ -354,13 +396,12 @@ TEST_CASE("SPR EQPIC update") {
 TEST_CASE("SPR reverse") {
     omp_set_num_threads(1);
     Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
 
     for (size_t i = 0; i < tree.edge_count(); ++i) {
         for (size_t j = 0; j < tree.edge_count(); ++j) {
             if (validSprMove(tree, i, j)) {
-                qsc.recomputeScores(tree, false);
+                qsc.recomputeScores(tree);
                 Tree t(tree);
                 auto lqic1 = qsc.getLQICScores();
                 spr(t, i, j);
@@ -369,11 +410,9 @@ TEST_CASE("SPR reverse") {
                 spr_lqic_update(t, i, j, qsc);
                 auto lqic2 = qsc.getLQICScores();
 
-                auto node_comparator = [] (TreeNode const& node_l,TreeNode const& node_r) {return node_r.data<DefaultNodeData>().name == node_l.data<DefaultNodeData>().name; };
-                auto edge_comparator = [] (TreeEdge const& edge_l,TreeEdge const& edge_r) {(void) edge_l; (void) edge_r; return true;};
                 REQUIRE(validate_topology(t));
 
-                REQUIRE(genesis::tree::equal(tree, t, node_comparator, edge_comparator));
+                REQUIRE(equal_topology(tree, t));
                 REQUIRE(lqic1 == lqic2);
             }
         }
@@ -383,14 +422,13 @@ TEST_CASE("SPR reverse") {
 TEST_CASE("SPR Generator") {
     omp_set_num_threads(1);
     Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
 
     spr_generator_qsc<uint64_t> genSPR(tree, &qsc, false);
     for (Tree t; genSPR(t);) {
         REQUIRE(validate_topology(t));
         std::vector<double> lqic1 = qsc.getLQICScores();
-        qsc.recomputeScores(t, false);
+        qsc.recomputeScores(t);
         std::vector<double> lqic2 = qsc.getLQICScores();
         //REQUIRE(lqic1 == lqic2);
         bool eq = true;
@@ -461,6 +499,29 @@ TEST_CASE("valid SPR move") {
     REQUIRE(validSprMove(tree, 12, 15) == false);
     REQUIRE(validSprMove(tree, 12, 14) == false);
     REQUIRE(validSprMove(tree, 12, 12) == false);
+
+    Tree yeast = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    for (Tree* t : { &tree, &yeast }) {
+        for (size_t k = 0; k < 3; ++k) {
+            const SprNeighborhood neighborhood(*t);
+            std::vector<size_t> regraft;
+            for (size_t i = 0; i < t->edge_count(); ++i) {
+                std::vector<size_t> expected;
+                for (size_t j = 0; j < t->edge_count(); ++j) {
+                    REQUIRE(neighborhood.valid(i, j) == validSprMove(*t, i, j));
+                    if (validSprMove(*t, i, j)) expected.push_back(j);
+                }
+                neighborhood.regraft_edges(i, regraft);
+                REQUIRE(regraft == expected);
+            }
+            // Move to another tree state.
+            for (size_t i = 3 * k + 1; i < t->edge_count(); ++i) {
+                if (!validSprMove(*t, i, 0)) continue;
+                spr(*t, i, 0);
+                break;
+            }
+        }
+    }
 }
 
 
@@ -473,13 +534,12 @@ TEST_CASE("recomputeScores") {
             }
         }
         }*/
-    size_t m = countEvalTrees("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc = QuartetScoreComputer<uint64_t>(tree, "../tests/data/yeast_all.tre", m, true, true);
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
     std::vector<double> lqic1 = qsc.getLQICScores();
 
-    Tree rand_tree = random_tree("../tests/data/yeast_all.tre");
-    QuartetScoreComputer<uint64_t> qsc2 =
-        QuartetScoreComputer<uint64_t>(rand_tree, "../tests/data/yeast_all.tre", m, true, true);
+    std::vector<std::string> leaves = yeast_counts().dictionary().names();
+    Tree rand_tree = random_tree_from_leaves(leaves);
+    TreeScores<uint64_t> qsc2(rand_tree, yeast_counts());
     tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
     /*for (size_t i = 0; i < tree.edge_count(); ++i) {
         for (size_t j = 0; j < tree.edge_count(); ++j) {
@@ -488,7 +548,7 @@ TEST_CASE("recomputeScores") {
             }
         }
         }*/
-    qsc2.recomputeScores(tree, false);
+    qsc2.recomputeScores(tree);
     std::vector<double> lqic2 = qsc2.getLQICScores();
     REQUIRE(lqic1==lqic2);
     /*bool eq = true;
@@ -497,3 +557,751 @@ TEST_CASE("recomputeScores") {
     }
     REQUIRE(eq);*/
 }
+
+TEST_CASE("Tree scores") {
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+    TreeScores<uint64_t> copy(qsc);
+    REQUIRE(&copy.quartet_counts() == &yeast_counts());
+
+    for (size_t e = 0; e < tree.edge_count(); ++e) {
+        const bool inner = tree.edge_at(e).primary_link().node().is_inner() and tree.edge_at(e).secondary_link().node().is_inner();
+        for (double s : { qsc.getLQICScores()[e], qsc.getQPICScores()[e], qsc.getEQPICScores()[e] }) {
+            if (inner) REQUIRE((s >= -1 and s <= 1));
+            else REQUIRE(s == TreeScores<uint64_t>::NO_SCORE);
+        }
+        // The per-edge updates agree with the full pass.
+        copy.recomputeLqicForEdge(tree, e);
+        copy.recomputeQpicForEdge(tree, e);
+        copy.recomputeEqpicForEdge(tree, e);
+    }
+    REQUIRE(copy.getLQICScores() == qsc.getLQICScores());
+    REQUIRE(copy.getQPICScores() == qsc.getQPICScores());
+    REQUIRE(copy.getEQPICScores() == qsc.getEQPICScores());
+}
+
+
+TEST_CASE("Parallel NNI search") {
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+    const QuartetCounts<uint64_t>& counts = yeast_counts();
+    Random::seed(1);
+    Tree start = make_random_nni_moves(tree, 10);
+
+    omp_set_num_threads(1);
+    Tree serial = treesearch_nni<uint64_t>(start, qsc, counts, LQIC, false);
+    double serial_score = sum_lqic_scores(qsc);
+    omp_set_num_threads(4);
+    Tree parallel = treesearch_nni<uint64_t>(start, qsc, counts, LQIC, false);
+    double parallel_score = sum_lqic_scores(qsc);
+    omp_set_num_threads(1);
+
+    REQUIRE(equal_topology(serial, parallel));
+    REQUIRE(serial_score == parallel_score);
+}
+
+TEST_CASE("Independent replicates") {
+    const QuartetCounts<uint64_t>& counts = yeast_counts();
+    auto search = [&](TreeScores<uint64_t>& qsc, size_t r) {
+        std::vector<std::string> leaves = counts.dictionary().names();
+        std::shuffle(leaves.begin(), leaves.end(), Random::engine());
+        Tree start = random_tree_from_leaves(leaves);
+        if (r % 2 == 1) {
+            qsc.recomputeScores(start);
+            return start;
+        }
+        return treesearch_nni<uint64_t>(start, qsc, counts, LqicObjective<uint64_t>(), false);
+    };
+
+    std::vector<Tree> serial_trees, parallel_trees;
+    std::vector<double> serial_scores, parallel_scores;
+    omp_set_num_threads(1);
+    const size_t serial = run_replicates<uint64_t, LqicObjective<uint64_t> >(counts, 6, 42, search, serial_trees, serial_scores);
+    omp_set_num_threads(4);
+    const size_t parallel = run_replicates<uint64_t, LqicObjective<uint64_t> >(counts, 6, 42, search, parallel_trees, parallel_scores);
+    omp_set_num_threads(1);
+
+    // Same seed, same replicates, whichever thread ran them.
+    REQUIRE(serial == parallel);
+    REQUIRE(serial_scores == parallel_scores);
+    for (size_t r = 0; r < 6; ++r)
+        REQUIRE(equal_topology(serial_trees[r], parallel_trees[r]));
+
+    // The best replicate is the first one with the highest score, and the scores are the trees'.
+    for (size_t r = 0; r < 6; ++r) {
+        if (r < serial) REQUIRE(serial_scores[r] < serial_scores[serial]);
+        else REQUIRE(serial_scores[r] <= serial_scores[serial]);
+        TreeScores<uint64_t> qsc(serial_trees[r], counts);
+        REQUIRE(Approx(sum_lqic_scores(qsc)) == serial_scores[r]);
+    }
+    // The searched replicates improve on the random trees.
+    REQUIRE(serial % 2 == 0);
+}
+
+TEST_CASE("Radius-limited SPR search") {
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+
+    const SprNeighborhood neighborhood(tree);
+    std::vector<size_t> all, near, expected;
+    for (size_t i = 0; i < tree.edge_count(); ++i) {
+        spr_regraft_edges_within(tree, i, tree.edge_count(), all);
+        for (size_t radius = 1; radius < 4; ++radius) {
+            spr_regraft_edges_within(tree, i, radius, near);
+            REQUIRE(std::equal(near.begin(), near.end(), all.begin()));
+        }
+        std::sort(all.begin(), all.end());
+        neighborhood.regraft_edges(i, expected);
+        REQUIRE(all == expected);
+    }
+
+    Random::seed(2);
+    Tree start = make_random_nni_moves(tree, 10);
+    qsc.recomputeScores(start);
+    const double start_score = sum_lqic_scores(qsc);
+    Tree result = treesearch_spr<uint64_t>(start, qsc, LQIC, false, 3);
+    const double score = sum_lqic_scores(qsc);
+    REQUIRE(validate_topology(result));
+    REQUIRE(score >= start_score);
+
+    // No SPR move within the radius improves the result.
+    for (size_t i = 0; i < result.edge_count(); ++i) {
+        spr_regraft_edges_within(result, i, 3, near);
+        for (size_t j : near) {
+            spr(result, i, j);
+            qsc.recomputeScores(result);
+            REQUIRE(sum_lqic_scores(qsc) <= score + 1e-9);
+            spr(result, i, j);
+        }
+    }
+}
+
+TEST_CASE("Objective policies") {
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+    Random::seed(3);
+    Tree start = make_random_nni_moves(tree, 10);
+
+    // The searches give the same result through the policy and through the runtime table.
+    Tree typed = treesearch_spr<uint64_t>(start, qsc, QpicObjective<uint64_t>(), false, 3);
+    const double typed_score = sum_qpic_scores(qsc);
+    const Functions<uint64_t> functions(QPIC);
+    REQUIRE(functions.id == QPIC);
+    Tree runtime = treesearch_spr<uint64_t>(start, qsc, functions, false, 3);
+    REQUIRE(equal_topology(typed, runtime));
+    REQUIRE(sum_qpic_scores(qsc) == typed_score);
+}
+
+TEST_CASE("Adaptive move proposals") {
+    WeightedSampler sampler(5);
+    for (size_t i = 0; i < 5; ++i) sampler.set(i, i % 2 ? 1.0 : 2.0);
+    REQUIRE(sampler.total() == 8.0);
+    REQUIRE(sampler.draw(0.0) == 0);
+    REQUIRE(sampler.draw(1.99) == 0);
+    REQUIRE(sampler.draw(2.0) == 1);
+    REQUIRE(sampler.draw(3.5) == 2);
+    REQUIRE(sampler.draw(7.99) == 4);
+    sampler.set(2, 0.0);
+    REQUIRE(sampler.draw(3.5) == 3);
+
+    // The kept scores match a recomputation on the moved tree. The LQIC updates only rescore the
+    // edges whose bipartition the move changed and carry the others over, so for LQIC only those
+    // edges are compared.
+    auto require_fresh_scores = [](const Tree& tree, const Move& move, TreeScores<uint64_t>& qsc,
+                                   const Functions<uint64_t>& functions, const ObjectiveSum<uint64_t>& objective_sum) {
+        TreeScores<uint64_t> fresh(yeast_counts());
+        fresh.recomputeScores(tree);
+        std::vector<size_t> edges;
+        if (functions.id != LQIC) for (size_t e = 0; e < tree.edge_count(); ++e) edges.push_back(e);
+        else if (move.type == MOVE_SPR) spr_lqic_path(tree, move.first, move.second, edges);
+        else edges.assign(1, move.first);
+        bool eq = true;
+        for (size_t e : edges) {
+            const double kept = functions.getScore(qsc, e), exact = functions.getScore(fresh, e);
+            if (kept != exact and Approx(kept) != exact) eq = false;
+        }
+        REQUIRE(eq);
+        REQUIRE(Approx(objective_sum.value()) == functions.obj_fun(qsc));
+        if (functions.id != LQIC) REQUIRE(Approx(objective_sum.value()) == functions.obj_fun(fresh));
+    };
+
+    for (ObjectiveFunction objective : { LQIC, QPIC, EQPIC }) {
+        Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+        TreeScores<uint64_t> qsc(tree, yeast_counts());
+        Functions<uint64_t> functions(objective);
+        ObjectiveSum<uint64_t> objective_sum(qsc, functions);
+        MoveProposer<uint64_t> proposer(tree, qsc, functions);
+        const double start = objective_sum.value();
+        const std::vector<double> start_scores = functions.getScores(qsc);
+
+        Random::seed(6);
+        for (size_t i = 0; i < 500; ++i) {
+            Tree before(tree);
+            Move move = proposer.propose(tree, objective_sum);
+            REQUIRE(validate_topology(tree));
+            if (move.type == MOVE_SPR) REQUIRE(validSprMove(before, move.first, move.second));
+            else REQUIRE(before.edge_at(move.first).secondary_link().node().is_inner());
+            require_fresh_scores(tree, move, qsc, functions, objective_sum);
+
+            apply_move(tree, move);
+            objective_sum.revert();
+            proposer.feedback(false, false, objective_sum);
+            REQUIRE(objective_sum.value() == start);
+            REQUIRE(functions.getScores(qsc) == start_scores);
+        }
+        // Rejecting every proposal does not starve a move type.
+        REQUIRE(proposer.type_probability(PROPOSE_SPR_FAR) > 0);
+
+        // Accepted SPRs turn inner edges into leaf edges and back; NNIs still only go to inner edges.
+        for (size_t i = 0; i < 500; ++i) {
+            Tree before(tree);
+            Move move = proposer.propose(tree, objective_sum);
+            if (move.type != MOVE_SPR) REQUIRE(before.edge_at(move.first).secondary_link().node().is_inner());
+            require_fresh_scores(tree, move, qsc, functions, objective_sum);
+            proposer.feedback(true, false, objective_sum);
+        }
+    }
+
+    // With a single inner edge, every NNI is drawn on it; without one, there is no move.
+    Functions<uint64_t> functions(LQIC);
+    const std::vector<std::string>& taxa = yeast_counts().dictionary().names();
+    Tree quartet = DefaultTreeNewickReader().from_string("((" + taxa[0] + "," + taxa[1] + ")," + taxa[2] + "," + taxa[3] + ");");
+    TreeScores<uint64_t> quartet_qsc(quartet, yeast_counts());
+    ObjectiveSum<uint64_t> quartet_sum(quartet_qsc, functions);
+    MoveProposer<uint64_t> quartet_proposer(quartet, quartet_qsc, functions);
+    size_t nnis = 0;
+    for (size_t i = 0; i < 100; ++i) {
+        Tree before(quartet);
+        Move move = quartet_proposer.propose(quartet, quartet_sum);
+        if (move.type != MOVE_SPR) {
+            REQUIRE(before.edge_at(move.first).secondary_link().node().is_inner());
+            nnis++;
+        }
+        quartet_proposer.feedback(true, false, quartet_sum);
+    }
+    REQUIRE(nnis > 0);
+    Tree triple = DefaultTreeNewickReader().from_string("(" + taxa[0] + "," + taxa[1] + "," + taxa[2] + ");");
+    TreeScores<uint64_t> triple_qsc(triple, yeast_counts());
+    REQUIRE_THROWS(MoveProposer<uint64_t>(triple, triple_qsc, functions));
+}
+
+TEST_CASE("Proposals do not allocate") {
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+    for (ObjectiveFunction objective : { LQIC, QPIC, EQPIC }) {
+        Functions<uint64_t> functions(objective);
+        qsc.recomputeScores(tree);
+        ObjectiveSum<uint64_t> objective_sum(qsc, functions);
+        MoveProposer<uint64_t> proposer(tree, qsc, functions);
+        Random::seed(4);
+        auto run = [&](size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                Move move = proposer.propose(tree, objective_sum);
+                if (i % 2 == 0) {
+                    proposer.feedback(true, false, objective_sum);
+                    continue;
+                }
+                apply_move(tree, move);
+                objective_sum.revert();
+                proposer.feedback(false, false, objective_sum);
+            }
+        };
+        // Scratch buffers reach their final size while warming up.
+        run(2000);
+        const size_t before = allocations;
+        run(1000);
+        const size_t after = allocations;
+        REQUIRE(after == before);
+    }
+}
+
+TEST_CASE("Random streams") {
+    Xoshiro256 a = Random::stream(7, 0);
+    Xoshiro256 b = Random::stream(7, 0);
+    Xoshiro256 c = Random::stream(7, 1);
+    Xoshiro256 d = Random::stream(8, 0);
+    bool differ_c = false, differ_d = false;
+    for (size_t i = 0; i < 100; ++i) {
+        const uint64_t x = a();
+        REQUIRE(x == b());
+        differ_c |= x != c();
+        differ_d |= x != d();
+    }
+    REQUIRE(differ_c);
+    REQUIRE(differ_d);
+
+    // A stream scope leaves the thread's own stream where it was.
+    Random::seed(7, 1);
+    Random::get_rand_int(-5, 5);
+    const int second = Random::get_rand_int(-5, 5);
+    Random::seed(7, 1);
+    Random::get_rand_int(-5, 5);
+    {
+        Xoshiro256 other = Random::stream(9, 0);
+        Random::StreamScope scope(other);
+        Random::get_rand_int(-5, 5);
+    }
+    REQUIRE(Random::get_rand_int(-5, 5) == second);
+    for (size_t i = 0; i < 1000; ++i) {
+        const int x = Random::get_rand_int(-5, 5);
+        REQUIRE(x >= -5);
+        REQUIRE(x <= 5);
+        const float f = Random::get_rand_float(2, 3);
+        REQUIRE(f >= 2);
+        REQUIRE(f < 3);
+    }
+}
+
+TEST_CASE("Parallel tempering") {
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+    Random::seed(4);
+    Tree start = make_random_nni_moves(tree, 10);
+    qsc.recomputeScores(start);
+    const double start_score = sum_lqic_scores(qsc);
+
+    omp_set_num_threads(3);
+    Random::seed(4);
+    Tree first = parallel_tempering<uint64_t>(start, qsc, LQIC, 3);
+    const double first_score = sum_lqic_scores(qsc);
+    // Every chain has its own random stream, so the thread count does not change the result.
+    omp_set_num_threads(1);
+    Random::seed(4);
+    Tree second = parallel_tempering<uint64_t>(start, qsc, LQIC, 3);
+
+    REQUIRE(validate_topology(first));
+    REQUIRE(first_score >= start_score);
+    REQUIRE(equal_topology(first, second));
+    REQUIRE_THROWS(parallel_tempering<uint64_t>(start, qsc, LQIC, 1));
+}
+
+TEST_CASE("Compact tree moves") {
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    CompactTree compact(tree);
+    const CompactTree::Snapshot start = compact.snapshot();
+
+    auto same = [&](const Tree& expected) {
+        Tree t(tree);
+        compact.write(t);
+        return validate_topology(t) and equal_topology(expected, t);
+    };
+
+    for (size_t e = 0; e < tree.edge_count(); ++e) {
+        if (!compact.is_inner_edge(e)) continue;
+        size_t mark = compact.mark();
+        compact.nni_a(e);
+        REQUIRE(same(nni_a(tree, e)));
+        compact.undo(mark);
+        compact.nni_b(e);
+        REQUIRE(same(nni_b(tree, e)));
+        compact.nni_b(e);
+        REQUIRE(compact.snapshot() == start);
+    }
+
+    for (size_t i = 0; i < tree.edge_count(); ++i) {
+        for (size_t j = 0; j < tree.edge_count(); ++j) {
+            REQUIRE(compact.valid_spr_move(i, j) == validSprMove(tree, i, j));
+            if (!compact.valid_spr_move(i, j)) continue;
+            Tree t(tree);
+            spr(t, i, j);
+            compact.spr(i, j);
+            REQUIRE(same(t));
+            compact.restore(start);
+        }
+    }
+
+    CompactTree growing(tree, 1);
+    for (size_t e = 0; e < tree.edge_count(); ++e) {
+        const size_t leaf = growing.insert_leaf(e);
+        REQUIRE(growing.is_leaf(leaf));
+        REQUIRE(growing.edge_count() == tree.edge_count() + 2);
+        growing.remove_leaf();
+        REQUIRE(growing.edge_count() == tree.edge_count());
+        Tree t(tree);
+        growing.write(t);
+        REQUIRE(equal_topology(tree, t));
+    }
+}
+
+TEST_CASE("Move journal") {
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    Tree t(tree);
+    MoveJournal journal;
+
+    for (size_t i = 0; i < t.edge_count(); ++i) {
+        Move move = nni_move((i % 2) ? NNI_A : NNI_B, i);
+        if (t.edge_at(i).secondary_link().node().is_leaf()) {
+            size_t j = (i * 7 + 3) % t.edge_count();
+            if (!validSprMove(t, i, j)) continue;
+            move = spr_move(i, j);
+        }
+        apply_move(t, move);
+        journal.record(move);
+    }
+    REQUIRE(validate_topology(t));
+
+    Tree replayed(tree);
+    journal.replay(replayed, 0, journal.size());
+    REQUIRE(equal_topology(t, replayed));
+
+    journal.undo(t);
+    REQUIRE(journal.size() == 0);
+    REQUIRE(equal_topology(tree, t));
+
+    // Below the cap the best tree is rebuilt from the moves, at the cap it is copied once and the
+    // journal stops growing.
+    for (size_t cap : { (size_t)1000, (size_t)5 }) {
+        BestTreeJournal<Tree> since_best(cap);
+        Tree walk(tree);
+        for (size_t i = 0; i < t.edge_count(); ++i) {
+            if (walk.edge_at(i).secondary_link().node().is_leaf()) continue;
+            const Move move = nni_move((i % 2) ? NNI_A : NNI_B, i);
+            apply_move(walk, move);
+            since_best.record(walk, move);
+            REQUIRE(since_best.size() <= cap);
+        }
+        REQUIRE_FALSE(equal_topology(tree, walk));
+        since_best.undo(walk);
+        REQUIRE(equal_topology(tree, walk));
+    }
+}
+
+TEST_CASE("Evaluation tree ingestion") {
+    EvalTrees evalTrees("../tests/data/yeast_all.tre");
+    REQUIRE(evalTrees.size() == 2494);
+    REQUIRE(evalTrees.taxa() == leafNames("../tests/data/yeast_all.tre"));
+
+    // The hash is taken while parsing; it must be FNV-1a of the raw file.
+    std::ifstream in("../tests/data/yeast_all.tre", std::ios::binary);
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c; in.get(c); ) hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+    REQUIRE(evalTrees.content_hash() == hash);
+    REQUIRE(EvalTrees("../tests/data/yeast_reference.tre").content_hash() != hash);
+
+    const TaxonDictionary& dictionary = evalTrees.dictionary();
+    for (size_t i = 0; i < dictionary.size(); ++i) REQUIRE(dictionary.id(dictionary.name(i)) == i);
+    REQUIRE_FALSE(dictionary.contains("not a taxon"));
+    REQUIRE_THROWS(dictionary.id("not a taxon"));
+    Tree tree = random_tree(evalTrees);
+    std::vector<size_t> taxa = dictionary.node_taxa(tree);
+    for (size_t i = 0; i < tree.node_count(); ++i) {
+        if (tree.node_at(i).is_leaf()) REQUIRE(dictionary.name(taxa[i]) == tree.node_at(i).data<DefaultNodeData>().name);
+        else REQUIRE(taxa[i] == dictionary.size());
+    }
+
+    std::vector<uint32_t> leaf_taxa;
+    std::vector<uint32_t> dist;
+    for (size_t t = 0; t < evalTrees.size(); ++t) {
+        evalTrees.leaf_distances(t, leaf_taxa, dist);
+        const size_t k = leaf_taxa.size();
+        for (size_t i = 0; i < k; ++i) {
+            REQUIRE(dist[i*k+i] == 0);
+            for (size_t j = i+1; j < k; ++j) {
+                REQUIRE(dist[i*k+j] == dist[j*k+i]);
+                REQUIRE(dist[i*k+j] >= 2);
+            }
+        }
+    }
+}
+
+TEST_CASE("Average linkage clustering") {
+    const double inf = std::numeric_limits<double>::infinity();
+    std::vector<std::vector<double> > distances = {
+        {   0,   2, 3.5,   8, inf },
+        {   2,   0,   5,   8,   9 },
+        { 3.5,   5,   0,   8,   9 },
+        {   8,   8,   8,   0,   3 },
+        { inf,   9,   9,   3,   0 }};
+    SymmetricMatrix<double> D(5);
+    for (size_t i = 0; i < 5; ++i)
+        for (size_t j = i; j < 5; ++j) D(i, j) = distances[i][j];
+    std::vector<size_t> items = { 0, 1, 2, 3, 4 };
+
+    // {0,1} is 4.25 away from 2 on average, so 2 stays on its own although it is close to 0.
+    std::vector<std::vector<size_t> > sets = average_linkage_clusters(D, items, 4);
+    REQUIRE(sets[0] == std::vector<size_t>({ 0, 1 }));
+    REQUIRE(sets[1].empty());
+    REQUIRE(sets[2] == std::vector<size_t>({ 2 }));
+    REQUIRE(sets[3] == std::vector<size_t>({ 3, 4 }));
+    REQUIRE(sets[4].empty());
+    REQUIRE(D(2, 0) == Approx(4.25));
+}
+
+TEST_CASE("Parallel average pairwise distances") {
+    EvalTrees evalTrees("../tests/data/yeast_all.tre");
+    omp_set_num_threads(1);
+    SymmetricMatrix<double> serial;
+    calculateAveragePairwiseDistance(serial, evalTrees);
+    omp_set_num_threads(4);
+    SymmetricMatrix<float> parallel;
+    calculateAveragePairwiseDistance(parallel, evalTrees);
+    omp_set_num_threads(1);
+
+    REQUIRE(serial.size() == evalTrees.taxa().size());
+    for (size_t i = 0; i < serial.size(); ++i) {
+        REQUIRE(serial(i, i) == 0);
+        for (size_t j = i+1; j < serial.size(); ++j) {
+            if (std::isinf(serial(i, j))) REQUIRE(std::isinf(parallel(j, i)));
+            else REQUIRE(Approx(serial(i, j)) == parallel(j, i));
+        }
+    }
+}
+
+TEST_CASE("Parallel quartet counting") {
+    EvalTrees evalTrees("../tests/data/yeast_all.tre");
+    omp_set_num_threads(1);
+    QuartetCounts<uint16_t> serial(evalTrees);
+    omp_set_num_threads(4);
+    QuartetCounts<uint16_t> parallel(evalTrees);
+    omp_set_num_threads(1);
+
+    const size_t n = serial.taxon_count();
+    for (size_t a = 0; a < n; ++a)
+        for (size_t b = a+1; b < n; ++b)
+            for (size_t c = b+1; c < n; ++c)
+                for (size_t d = c+1; d < n; ++d)
+                    REQUIRE(serial.get(a, b, c, d) == parallel.get(a, b, c, d));
+}
+
+TEST_CASE("Saved quartet counts") {
+    EvalTrees evalTrees("../tests/data/yeast_all.tre");
+    QuartetCounts<uint16_t> counts(evalTrees);
+    counts.save("yeast_all.quartets");
+    QuartetCounts<uint16_t> loaded(evalTrees, "yeast_all.quartets");
+
+    REQUIRE(loaded.taxon_count() == counts.taxon_count());
+    const size_t n = counts.taxon_count();
+    for (size_t a = 0; a < n; ++a) {
+        REQUIRE(loaded.taxon_name(a) == counts.taxon_name(a));
+        for (size_t b = a+1; b < n; ++b)
+            for (size_t c = b+1; c < n; ++c)
+                for (size_t d = c+1; d < n; ++d)
+                    REQUIRE(loaded.get(a, b, c, d) == counts.get(a, b, c, d));
+    }
+
+    REQUIRE_THROWS(QuartetCounts<uint32_t>(evalTrees, "yeast_all.quartets"));
+    REQUIRE_THROWS(QuartetCounts<uint16_t>(EvalTrees("../tests/data/yeast_reference.tre"), "yeast_all.quartets"));
+    std::remove("yeast_all.quartets");
+}
+
+TEST_CASE("NNI score delta") {
+    omp_set_num_threads(1);
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+    const QuartetCounts<uint64_t>& counts = yeast_counts();
+    CompactTree compact(tree);
+
+    for (ObjectiveFunction objective : { LQIC, QPIC, EQPIC }) {
+        Functions<uint64_t> functions(objective);
+        DeltaScorer<uint64_t> scorer(tree, counts, objective);
+        qsc.recomputeScores(tree);
+
+        for (size_t e = 0; e < tree.edge_count(); ++e) {
+            if (tree.edge_at(e).secondary_link().node().is_leaf()) continue;
+            double before = functions.obj_fun(qsc);
+
+            double delta = score_delta_nni(compact, e, NNI_A, scorer);
+            functions.nni_a(tree, e, qsc);
+            REQUIRE(Approx(functions.obj_fun(qsc) - before) == delta);
+            functions.nni_a(tree, e, qsc);
+
+            delta = score_delta_nni(compact, e, NNI_B, scorer);
+            functions.nni_b(tree, e, qsc);
+            REQUIRE(Approx(functions.obj_fun(qsc) - before) == delta);
+            functions.nni_b(tree, e, qsc);
+        }
+    }
+}
+
+TEST_CASE("Running objective sum") {
+    omp_set_num_threads(1);
+    Tree tree = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(tree, yeast_counts());
+
+    for (ObjectiveFunction objective : { LQIC, QPIC, EQPIC }) {
+        Functions<uint64_t> functions(objective);
+        qsc.recomputeScores(tree);
+        ObjectiveSum<uint64_t> objective_sum(qsc, functions);
+        const double start = objective_sum.value();
+        const std::vector<double> start_scores = functions.getScores(qsc);
+        REQUIRE(Approx(start) == functions.obj_fun(qsc));
+
+        for (size_t i = 0; i < tree.edge_count(); i += 5) {
+            for (size_t j = 0; j < tree.edge_count(); j += 3) {
+                if (!validSprMove(tree, i, j)) continue;
+                spr(tree, i, j);
+                functions.spr_score_update(tree, i, j, qsc);
+                objective_sum.spr_update(tree, i, j);
+                REQUIRE(Approx(objective_sum.value()) == functions.obj_fun(qsc));
+
+                spr(tree, i, j);
+                functions.spr_score_update(tree, i, j, qsc);
+                objective_sum.spr_update(tree, i, j);
+                REQUIRE(objective_sum.value() == start);
+
+                // Undo as the annealer does: replay the move, put back the touched scores.
+                spr(tree, i, j);
+                functions.spr_score_update(tree, i, j, qsc);
+                objective_sum.spr_update(tree, i, j);
+                spr(tree, i, j);
+                objective_sum.revert();
+                REQUIRE(objective_sum.value() == start);
+                REQUIRE(functions.getScores(qsc) == start_scores);
+            }
+        }
+        for (size_t e = 0; e < tree.edge_count(); ++e) {
+            if (tree.edge_at(e).secondary_link().node().is_leaf()) continue;
+            functions.nni_a(tree, e, qsc);
+            objective_sum.nni_update(tree, e);
+            nni_a_inplace(tree, e);
+            objective_sum.revert();
+            REQUIRE(objective_sum.value() == start);
+            REQUIRE(functions.getScores(qsc) == start_scores);
+        }
+    }
+}
+
+TEST_CASE("Stepwise insertion scores") {
+    omp_set_num_threads(1);
+    Tree reference = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(reference, yeast_counts());
+    const QuartetCounts<uint64_t>& counts = yeast_counts();
+
+    std::vector<std::string> leaves(counts.dictionary().names().begin(), counts.dictionary().names().begin() + 10);
+    const std::string inserted = leaves.back();
+    leaves.pop_back();
+    Tree tree = random_tree_from_leaves(leaves);
+    CompactTree compact(tree);
+
+    for (ObjectiveFunction objective : { LQIC, QPIC, EQPIC }) {
+        Functions<uint64_t> functions(objective);
+        DeltaScorer<uint64_t> scorer(tree, counts, objective);
+        std::vector<double> gain;
+        score_insertions(compact, counts.taxon_id(inserted), scorer, gain);
+        REQUIRE(gain.size() == tree.edge_count());
+
+        std::vector<double> value(tree.edge_count());
+        for (size_t f = 0; f < tree.edge_count(); ++f) {
+            Tree tnew(tree);
+            add_new_node(tnew, tnew.edge_at(f)).secondary_link().node().data_cast<DefaultNodeData>()->name = inserted;
+            qsc.recomputeScores(tnew);
+            value[f] = functions.obj_fun(qsc);
+        }
+        for (size_t f = 1; f < tree.edge_count(); ++f) REQUIRE(Approx(value[f] - value[0]).margin(1e-9) == gain[f] - gain[0]);
+
+        // Supports carried from step to step give the edge scores of the grown tree.
+        std::vector<std::string> more(counts.dictionary().names().begin() + 10, counts.dictionary().names().begin() + 16);
+        Tree grown(tree);
+        InsertionSupports supports;
+        while (!more.empty()) {
+            stepwise_addition_step(grown, counts, more.back(), objective, gain, supports);
+            more.pop_back();
+            qsc.recomputeScores(grown);
+            const std::vector<double>& expected = functions.getScores(qsc);
+            REQUIRE(supports.edge.size() == grown.edge_count());
+            for (size_t g = 0; g < grown.edge_count(); ++g) {
+                if (expected[g] == TreeScores<uint64_t>::NO_SCORE) continue;
+                REQUIRE(Approx(supports.edge[g].score(objective)).margin(1e-9) == expected[g]);
+            }
+        }
+    }
+}
+
+TEST_CASE("Parallel stepwise addition") {
+    const QuartetCounts<uint64_t>& counts = yeast_counts();
+
+    for (ObjectiveFunction objective : { LQIC, QPIC, EQPIC }) {
+        std::vector<std::string> leaves = counts.dictionary().names();
+        Random::seed(3);
+        std::shuffle(leaves.begin(), leaves.end(), Random::engine());
+        std::vector<std::string> leaves_parallel = leaves;
+
+        omp_set_num_threads(1);
+        Tree serial = stepwise_addition_tree_from_leaves<uint64_t>(counts, leaves, objective);
+        omp_set_num_threads(4);
+        Tree parallel = stepwise_addition_tree_from_leaves<uint64_t>(counts, leaves_parallel, objective);
+        omp_set_num_threads(1);
+
+        REQUIRE(equal_topology(serial, parallel));
+    }
+}
+
+TEST_CASE("Multi-order stepwise addition") {
+    Tree reference = DefaultTreeNewickReader().from_file("../tests/data/yeast_reference.tre");
+    TreeScores<uint64_t> qsc(reference, yeast_counts());
+    const QuartetCounts<uint64_t>& counts = yeast_counts();
+    const double inf = std::numeric_limits<double>::infinity();
+
+    std::vector<std::string> leaves = counts.dictionary().names();
+    Tree single = stepwise_addition_tree_from_leaves<uint64_t>(counts, leaves, LQIC);
+    qsc.recomputeScores(single);
+    const double single_score = sum_lqic_scores(qsc);
+
+    // The given order comes first, the others are distinct shuffles of it.
+    Random::seed(5);
+    std::vector<std::vector<std::string> > orders = stepwise_addition_orders(counts.dictionary().names(), 8);
+    REQUIRE(orders[0] == counts.dictionary().names());
+    for (size_t i = 0; i < orders.size(); ++i) {
+        REQUIRE(std::is_permutation(orders[i].begin(), orders[i].end(), orders[0].begin()));
+        for (size_t j = i+1; j < orders.size(); ++j) REQUIRE(orders[i] != orders[j]);
+    }
+
+    omp_set_num_threads(1);
+    Random::seed(5);
+    Tree serial = multi_order_stepwise_addition_tree<uint64_t>(counts, counts.dictionary().names(), LQIC, 8, inf);
+    omp_set_num_threads(4);
+    Random::seed(5);
+    Tree parallel = multi_order_stepwise_addition_tree<uint64_t>(counts, counts.dictionary().names(), LQIC, 8, inf);
+    omp_set_num_threads(1);
+
+    REQUIRE(equal_topology(serial, parallel));
+    qsc.recomputeScores(serial);
+    REQUIRE(sum_lqic_scores(qsc) >= single_score - 1e-9);
+
+    // The given order is never abandoned, so pruning never makes the result worse, and the bound
+    // only changes between steps, so pruned runs do not depend on the thread count either.
+    omp_set_num_threads(4);
+    Random::seed(5);
+    Tree pruned = multi_order_stepwise_addition_tree<uint64_t>(counts, counts.dictionary().names(), LQIC, 8, 0);
+    omp_set_num_threads(1);
+    Random::seed(5);
+    Tree pruned_serial = multi_order_stepwise_addition_tree<uint64_t>(counts, counts.dictionary().names(), LQIC, 8, 0);
+    REQUIRE(equal_topology(pruned, pruned_serial));
+    qsc.recomputeScores(pruned);
+    REQUIRE(sum_lqic_scores(qsc) >= single_score - 1e-9);
+}
+
+TEST_CASE("Branch and bound exhaustive search") {
+    Tree reference = DefaultTreeNewickReader().from_file("../tests/data/small_reference.tre");
+    EvalTrees evalTrees("../tests/data/small_all.tre");
+    QuartetCounts<uint64_t> counts(evalTrees);
+    TreeScores<uint64_t> qsc(reference, counts);
+
+    for (ObjectiveFunction objective : { LQIC, EQPIC }) {
+        std::function<double(TreeScores<uint64_t>&)> score = objective == LQIC ? sum_lqic_scores<uint64_t> : sum_eqpic_scores<uint64_t>;
+        double best = 0;
+        Random::seed(3);
+        for (size_t i = 0; i < 4; ++i) {
+            std::vector<std::string> leaves = evalTrees.taxa();
+            std::shuffle(leaves.begin(), leaves.end(), Random::engine());
+            std::vector<std::string> stepwise_leaves(leaves);
+            Tree stepwise = stepwise_addition_tree_from_leaves<uint64_t>(counts, stepwise_leaves, objective);
+            qsc.recomputeScores(stepwise);
+            const double stepwise_score = score(qsc);
+
+            std::vector<std::string> parallel_leaves(leaves);
+            Tree exhaustive = exhaustive_search_from_leaves<uint64_t>(counts, leaves, objective);
+            omp_set_num_threads(4);
+            Tree parallel = exhaustive_search_from_leaves<uint64_t>(counts, parallel_leaves, objective);
+            omp_set_num_threads(1);
+            REQUIRE(validate_topology(exhaustive));
+            // Ties are broken by Newick string, not by which task finds its tree first.
+            REQUIRE(equal_topology(exhaustive, parallel));
+            qsc.recomputeScores(exhaustive);
+            REQUIRE(score(qsc) >= stepwise_score - 1e-9);
+            // The optimum does not depend on the order of insertion.
+            if (i > 0) REQUIRE(score(qsc) == Approx(best).margin(1e-9));
+            best = score(qsc);
+        }
+    }
+}